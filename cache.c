@@ -10,13 +10,31 @@
  */
 
 #include <linux/slab.h>
+#include <linux/shrinker.h>
 #include "fat_prfs.h"
 
+/*
+ * Each inode caches the extents (runs of contiguous clusters) of its
+ * chain in an rbtree by file cluster, with an LRU list to recycle the
+ * oldest one when the inode is at its budget. The budget grows with the
+ * file size, so a fragmented file keeps more of its mapping; the memory
+ * used by all inodes is bounded by the fat_cache shrinker.
+ *
+ * With the "mapahead" option, opening a large file caches its whole map
+ * in one pass over the FAT. Such an inode has no budget until the cache
+ * is invalidated or the shrinker takes from it.
+ */
+
 /* this must be > 0. */
 #define FAT_MAX_CACHE	8
+/* one more cache allowed per 2^FAT_CACHE_CLUS_SHIFT file clusters */
+#define FAT_CACHE_CLUS_SHIFT	4
+/* mapahead: files beyond what the default budget covers */
+#define FAT_MAPAHEAD_MIN	(FAT_MAX_CACHE << FAT_CACHE_CLUS_SHIFT)
 
 struct fat_cache {
-	struct list_head cache_list;
+	struct rb_node cache_node;	/* in ->cache_tree, by fcluster */
+	struct list_head cache_list;	/* in ->cache_lru */
 	int nr_contig;	/* number of contiguous clusters */
 	int fcluster;	/* cluster number in the file. */
 	int dcluster;	/* cluster number on disk. */
@@ -31,45 +49,122 @@ struct fat_cache_id {
 
 static inline int fat_max_cache(struct inode *inode)
 {
-	return FAT_MAX_CACHE;
+	struct msdos_sb_info *sbi = MSDOS_SB(inode->i_sb);
+	unsigned long nr_clus = inode->i_blocks >> (sbi->cluster_bits - 9);
+
+	if (MSDOS_I(inode)->cache_full)
+		return INT_MAX;
+	return max_t(unsigned long, FAT_MAX_CACHE,
+		     min_t(unsigned long, INT_MAX,
+			   nr_clus >> FAT_CACHE_CLUS_SHIFT));
 }
 
 static struct kmem_cache *fat_cache_cachep;
 
+/* The inodes holding caches, for the shrinker */
+static LIST_HEAD(fat_cache_inodes);
+static DEFINE_SPINLOCK(fat_cache_inodes_lock);
+static atomic_long_t fat_cache_count = ATOMIC_LONG_INIT(0);
+
 static void init_once(void *foo)
 {
 	struct fat_cache *cache = (struct fat_cache *)foo;
 
+	RB_CLEAR_NODE(&cache->cache_node);
 	INIT_LIST_HEAD(&cache->cache_list);
 }
 
+static inline struct fat_cache *fat_cache_alloc(struct inode *inode)
+{
+	return kmem_cache_alloc(fat_cache_cachep, GFP_NOFS);
+}
+
+static inline void fat_cache_free(struct fat_cache *cache)
+{
+	BUG_ON(!list_empty(&cache->cache_list));
+	kmem_cache_free(fat_cache_cachep, cache);
+}
+
+/* Drop the least recently used cache of @i. Caller holds cache_lru_lock. */
+static void fat_cache_evict(struct msdos_inode_info *i)
+{
+	struct fat_cache *cache;
+
+	cache = list_last_entry(&i->cache_lru, struct fat_cache, cache_list);
+	list_del_init(&cache->cache_list);
+	rb_erase(&cache->cache_node, &i->cache_tree);
+	i->nr_caches--;
+	atomic_long_dec(&fat_cache_count);
+	fat_cache_free(cache);
+}
+
+static unsigned long fat_cache_shrink_count(struct shrinker *shrink,
+					    struct shrink_control *sc)
+{
+	return atomic_long_read(&fat_cache_count);
+}
+
+static unsigned long fat_cache_shrink_scan(struct shrinker *shrink,
+					   struct shrink_control *sc)
+{
+	struct msdos_inode_info *i, *tmp;
+	unsigned long freed = 0;
+	int nr;
+
+	spin_lock(&fat_cache_inodes_lock);
+	list_for_each_entry_safe(i, tmp, &fat_cache_inodes, cache_inodes) {
+		if (freed >= sc->nr_to_scan)
+			break;
+		/* The lock order is cache_lru_lock, then fat_cache_inodes_lock */
+		if (!spin_trylock(&i->cache_lru_lock))
+			continue;
+		/* the older half of each inode's caches */
+		i->cache_full = 0;
+		nr = min_t(unsigned long, max(i->nr_caches / 2, 1),
+			   sc->nr_to_scan - freed);
+		while (nr-- > 0 && i->nr_caches) {
+			fat_cache_evict(i);
+			freed++;
+		}
+		if (!i->nr_caches)
+			list_del_init(&i->cache_inodes);
+		else
+			list_move_tail(&i->cache_inodes, &fat_cache_inodes);
+		spin_unlock(&i->cache_lru_lock);
+	}
+	spin_unlock(&fat_cache_inodes_lock);
+
+	return freed;
+}
+
+static struct shrinker fat_cache_shrinker = {
+	.count_objects	= fat_cache_shrink_count,
+	.scan_objects	= fat_cache_shrink_scan,
+	.seeks		= DEFAULT_SEEKS,
+};
+
 int __init fat_cache_init(void)
 {
+	int err;
+
 	fat_cache_cachep = kmem_cache_create("fat_cache",
 				sizeof(struct fat_cache),
 				0, SLAB_RECLAIM_ACCOUNT|SLAB_MEM_SPREAD,
 				init_once);
 	if (fat_cache_cachep == NULL)
 		return -ENOMEM;
-	return 0;
+	err = register_shrinker(&fat_cache_shrinker, "fat-cache");
+	if (err)
+		kmem_cache_destroy(fat_cache_cachep);
+	return err;
 }
 
 void fat_cache_destroy(void)
 {
+	unregister_shrinker(&fat_cache_shrinker);
 	kmem_cache_destroy(fat_cache_cachep);
 }
 
-static inline struct fat_cache *fat_cache_alloc(struct inode *inode)
-{
-	return kmem_cache_alloc(fat_cache_cachep, GFP_NOFS);
-}
-
-static inline void fat_cache_free(struct fat_cache *cache)
-{
-	BUG_ON(!list_empty(&cache->cache_list));
-	kmem_cache_free(fat_cache_cachep, cache);
-}
-
 static inline void fat_cache_update_lru(struct inode *inode,
 					struct fat_cache *cache)
 {
@@ -81,35 +176,39 @@ static int fat_cache_lookup(struct inode *inode, int fclus,
 			    struct fat_cache_id *cid,
 			    int *cached_fclus, int *cached_dclus)
 {
-	static struct fat_cache nohit = { .fcluster = 0, };
-
-	struct fat_cache *hit = &nohit, *p;
+	struct msdos_inode_info *i = MSDOS_I(inode);
+	struct fat_cache *hit = NULL, *p;
+	struct rb_node *n;
 	int offset = -1;
 
-	spin_lock(&MSDOS_I(inode)->cache_lru_lock);
-	list_for_each_entry(p, &MSDOS_I(inode)->cache_lru, cache_list) {
-		/* Find the cache of "fclus" or nearest cache. */
-		if (p->fcluster <= fclus && hit->fcluster < p->fcluster) {
+	spin_lock(&i->cache_lru_lock);
+	/* Find the cache of "fclus" or nearest cache. */
+	n = i->cache_tree.rb_node;
+	while (n) {
+		p = rb_entry(n, struct fat_cache, cache_node);
+		if (fclus < p->fcluster) {
+			n = n->rb_left;
+		} else {
 			hit = p;
-			if ((hit->fcluster + hit->nr_contig) < fclus) {
-				offset = hit->nr_contig;
-			} else {
-				offset = fclus - hit->fcluster;
-				break;
-			}
+			n = n->rb_right;
 		}
 	}
-	if (hit != &nohit) {
+	if (hit) {
+		if ((hit->fcluster + hit->nr_contig) < fclus)
+			offset = hit->nr_contig;
+		else
+			offset = fclus - hit->fcluster;
+
 		fat_cache_update_lru(inode, hit);
 
-		cid->id = MSDOS_I(inode)->cache_valid_id;
+		cid->id = i->cache_valid_id;
 		cid->nr_contig = hit->nr_contig;
 		cid->fcluster = hit->fcluster;
 		cid->dcluster = hit->dcluster;
 		*cached_fclus = cid->fcluster + offset;
 		*cached_dclus = cid->dcluster + offset;
 	}
-	spin_unlock(&MSDOS_I(inode)->cache_lru_lock);
+	spin_unlock(&i->cache_lru_lock);
 
 	return offset;
 }
@@ -117,11 +216,17 @@ static int fat_cache_lookup(struct inode *inode, int fclus,
 static struct fat_cache *fat_cache_merge(struct inode *inode,
 					 struct fat_cache_id *new)
 {
+	struct rb_node *n = MSDOS_I(inode)->cache_tree.rb_node;
 	struct fat_cache *p;
 
-	list_for_each_entry(p, &MSDOS_I(inode)->cache_lru, cache_list) {
-		/* Find the same part as "new" in cluster-chain. */
-		if (p->fcluster == new->fcluster) {
+	while (n) {
+		p = rb_entry(n, struct fat_cache, cache_node);
+		if (new->fcluster < p->fcluster) {
+			n = n->rb_left;
+		} else if (new->fcluster > p->fcluster) {
+			n = n->rb_right;
+		} else {
+			/* Find the same part as "new" in cluster-chain. */
 			BUG_ON(p->dcluster != new->dcluster);
 			if (new->nr_contig > p->nr_contig)
 				p->nr_contig = new->nr_contig;
@@ -131,69 +236,107 @@ static struct fat_cache *fat_cache_merge(struct inode *inode,
 	return NULL;
 }
 
+static void fat_cache_insert(struct inode *inode, struct fat_cache *cache)
+{
+	struct rb_root *root = &MSDOS_I(inode)->cache_tree;
+	struct rb_node **p = &root->rb_node, *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (cache->fcluster < rb_entry(parent, struct fat_cache,
+					       cache_node)->fcluster)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&cache->cache_node, parent, p);
+	rb_insert_color(&cache->cache_node, root);
+}
+
+static inline bool fat_cache_id_valid(struct inode *inode,
+				      struct fat_cache_id *new)
+{
+	return new->id == FAT_CACHE_VALID ||
+		new->id == MSDOS_I(inode)->cache_valid_id;
+}
+
 static void fat_cache_add(struct inode *inode, struct fat_cache_id *new)
 {
+	struct msdos_inode_info *i = MSDOS_I(inode);
 	struct fat_cache *cache, *tmp;
 
 	if (new->fcluster == -1) /* dummy cache */
 		return;
 
-	spin_lock(&MSDOS_I(inode)->cache_lru_lock);
-	if (new->id != FAT_CACHE_VALID &&
-	    new->id != MSDOS_I(inode)->cache_valid_id)
+	spin_lock(&i->cache_lru_lock);
+	if (!fat_cache_id_valid(inode, new))
 		goto out;	/* this cache was invalidated */
 
 	cache = fat_cache_merge(inode, new);
 	if (cache == NULL) {
-		if (MSDOS_I(inode)->nr_caches < fat_max_cache(inode)) {
-			MSDOS_I(inode)->nr_caches++;
-			spin_unlock(&MSDOS_I(inode)->cache_lru_lock);
+		if (i->nr_caches < fat_max_cache(inode)) {
+			i->nr_caches++;
+			spin_unlock(&i->cache_lru_lock);
 
 			tmp = fat_cache_alloc(inode);
 			if (!tmp) {
-				spin_lock(&MSDOS_I(inode)->cache_lru_lock);
-				MSDOS_I(inode)->nr_caches--;
-				spin_unlock(&MSDOS_I(inode)->cache_lru_lock);
+				spin_lock(&i->cache_lru_lock);
+				i->nr_caches--;
+				spin_unlock(&i->cache_lru_lock);
 				return;
 			}
 
-			spin_lock(&MSDOS_I(inode)->cache_lru_lock);
+			spin_lock(&i->cache_lru_lock);
+			if (!fat_cache_id_valid(inode, new)) {
+				i->nr_caches--;
+				fat_cache_free(tmp);
+				goto out;
+			}
 			cache = fat_cache_merge(inode, new);
 			if (cache != NULL) {
-				MSDOS_I(inode)->nr_caches--;
+				i->nr_caches--;
 				fat_cache_free(tmp);
 				goto out_update_lru;
 			}
 			cache = tmp;
+			atomic_long_inc(&fat_cache_count);
+			if (list_empty(&i->cache_inodes)) {
+				spin_lock(&fat_cache_inodes_lock);
+				list_add_tail(&i->cache_inodes,
+					      &fat_cache_inodes);
+				spin_unlock(&fat_cache_inodes_lock);
+			}
 		} else {
-			struct list_head *p = MSDOS_I(inode)->cache_lru.prev;
-			cache = list_entry(p, struct fat_cache, cache_list);
+			/* Recycle the least recently used one */
+			cache = list_last_entry(&i->cache_lru,
+						struct fat_cache, cache_list);
+			rb_erase(&cache->cache_node, &i->cache_tree);
 		}
 		cache->fcluster = new->fcluster;
 		cache->dcluster = new->dcluster;
 		cache->nr_contig = new->nr_contig;
+		fat_cache_insert(inode, cache);
 	}
 out_update_lru:
 	fat_cache_update_lru(inode, cache);
 out:
-	spin_unlock(&MSDOS_I(inode)->cache_lru_lock);
+	spin_unlock(&i->cache_lru_lock);
 }
 
 /*
- * Cache invalidation occurs rarely, thus the LRU chain is not updated. It
- * fixes itself after a while.
+ * Cache invalidation occurs rarely, so all the caches are simply freed.
  */
 static void __fat_cache_inval_inode(struct inode *inode)
 {
 	struct msdos_inode_info *i = MSDOS_I(inode);
-	struct fat_cache *cache;
 
-	while (!list_empty(&i->cache_lru)) {
-		cache = list_entry(i->cache_lru.next,
-				   struct fat_cache, cache_list);
-		list_del_init(&cache->cache_list);
-		i->nr_caches--;
-		fat_cache_free(cache);
+	while (!list_empty(&i->cache_lru))
+		fat_cache_evict(i);
+	i->cache_full = 0;
+	if (!list_empty(&i->cache_inodes)) {
+		spin_lock(&fat_cache_inodes_lock);
+		list_del_init(&i->cache_inodes);
+		spin_unlock(&fat_cache_inodes_lock);
 	}
 	/* Update. The copy of caches before this id is discarded. */
 	i->cache_valid_id++;
@@ -208,6 +351,55 @@ void fat_cache_inval_inode(struct inode *inode)
 	spin_unlock(&MSDOS_I(inode)->cache_lru_lock);
 }
 
+static void fat_cache_map_actor(struct inode *inode, int fclus, int dclus,
+				int nr_contig, void *data)
+{
+	struct fat_cache_id cid = {
+		.id = *(unsigned int *)data,
+		.fcluster = fclus,
+		.dcluster = dclus,
+		.nr_contig = nr_contig,
+	};
+
+	fat_cache_add(inode, &cid);
+}
+
+/*
+ * mapahead: cache all the extents of a large file, so that no access
+ * has to follow the chain. Called on open.
+ */
+int fat_cache_map_inode(struct inode *inode)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(inode->i_sb);
+	struct msdos_inode_info *i = MSDOS_I(inode);
+	unsigned int id;
+	int err;
+
+	if ((inode->i_blocks >> (sbi->cluster_bits - 9)) < FAT_MAPAHEAD_MIN)
+		return 0;
+
+	/* Keep truncate away from the chain */
+	inode_lock_shared(inode);
+	spin_lock(&i->cache_lru_lock);
+	if (i->cache_full || !i->i_start) {
+		spin_unlock(&i->cache_lru_lock);
+		inode_unlock_shared(inode);
+		return 0;
+	}
+	i->cache_full = 1;
+	id = i->cache_valid_id;
+	spin_unlock(&i->cache_lru_lock);
+
+	err = fat_ent_walk_chain(inode, fat_cache_map_actor, &id);
+	if (err) {
+		spin_lock(&i->cache_lru_lock);
+		i->cache_full = 0;
+		spin_unlock(&i->cache_lru_lock);
+	}
+	inode_unlock_shared(inode);
+	return err;
+}
+
 static inline int cache_contiguous(struct fat_cache_id *cid, int dclus)
 {
 	cid->nr_contig++;
@@ -278,8 +470,12 @@ int fat_get_cluster(struct inode *inode, int cluster, int *fclus, int *dclus)
 		}
 		(*fclus)++;
 		*dclus = nr;
-		if (!cache_contiguous(&cid, *dclus))
+		if (!cache_contiguous(&cid, *dclus)) {
+			/* Keep every extent on the way, not just the last */
+			cid.nr_contig--;
+			fat_cache_add(inode, &cid);
 			cache_init(&cid, *fclus, *dclus);
+		}
 	}
 	nr = 0;
 	fat_cache_add(inode, &cid);
@@ -288,6 +484,71 @@ out:
 	return nr;
 }
 
+/*
+ * Map file cluster @cluster to its disk cluster in *dclus, and count in
+ * *len the clusters contiguous on disk from there, up to @max. iomap maps
+ * a whole extent at once with it; the run found is cached.
+ */
+int fat_get_extent(struct inode *inode, int cluster, int max, int *dclus,
+		   int *len)
+{
+	struct fat_entry fatent;
+	struct fat_cache_id cid;
+	int fclus, cached_fclus, cached_dclus, offset, nr;
+
+	nr = fat_get_cluster(inode, cluster, &fclus, dclus);
+	if (nr < 0)
+		return nr;
+	else if (nr == FAT_ENT_EOF) {
+		fat_fs_error(inode->i_sb, "%s: request beyond EOF (i_pos %lld)",
+			     __func__, MSDOS_I(inode)->i_pos);
+		return -EIO;
+	}
+
+	/* The cache may know the run already */
+	offset = fat_cache_lookup(inode, cluster, &cid, &cached_fclus,
+				  &cached_dclus);
+	if (offset >= 0 && cached_fclus == cluster) {
+		*len = min(cid.nr_contig - offset + 1, max);
+		if (*len == max)
+			return 0;
+	} else {
+		cache_init(&cid, cluster, *dclus);
+		*len = 1;
+	}
+
+	/* Follow the chain while it stays contiguous */
+	nr = 0;
+	fatent_init(&fatent);
+	while (*len < max) {
+		nr = fat_ent_read(inode, &fatent, *dclus + *len - 1);
+		if (nr < 0)
+			break;
+		if (nr != *dclus + *len)
+			break;
+		(*len)++;
+		cid.nr_contig++;
+	}
+	fatent_brelse(&fatent);
+	fat_cache_add(inode, &cid);
+
+	return nr < 0 ? nr : 0;
+}
+
+/* fat_get_extent() without reading the FAT: -EAGAIN if not cached. */
+int fat_get_extent_cached(struct inode *inode, int cluster, int max,
+			  int *dclus, int *len)
+{
+	struct fat_cache_id cid;
+	int fclus, offset;
+
+	offset = fat_cache_lookup(inode, cluster, &cid, &fclus, dclus);
+	if (offset < 0 || fclus != cluster)
+		return -EAGAIN;
+	*len = min(cid.nr_contig - offset + 1, max);
+	return 0;
+}
+
 static int fat_bmap_cluster(struct inode *inode, int cluster)
 {
 	struct super_block *sb = inode->i_sb;
@@ -352,6 +613,16 @@ static int is_exceed_eof(struct inode *inode, sector_t sector,
 			return 1;
 	}
 
+	/* Delayed allocation: no cluster yet past the allocated ones */
+	if (MSDOS_I(inode)->i_reserved) {
+		sector_t nr_alloc = inode->i_blocks >> (blocksize_bits - 9);
+
+		if (*last_block > nr_alloc)
+			*last_block = nr_alloc;
+		if (sector >= *last_block)
+			return 1;
+	}
+
 	return 0;
 }
 
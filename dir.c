@@ -15,9 +15,11 @@
  */
 
 #include <linux/slab.h>
+#include <linux/blkdev.h>
 #include <linux/compat.h>
 #include <linux/uaccess.h>
 #include <linux/iversion.h>
+#include <asm/unaligned.h>
 #include "fat_prfs.h"
 
 /*
@@ -46,27 +48,54 @@ static inline loff_t fat_make_i_pos(struct super_block *sb,
 		| (de - (struct msdos_dir_entry *)bh->b_data);
 }
 
-static inline void fat_dir_readahead(struct inode *dir, sector_t iblock,
-				     sector_t phys)
+/* How much of a directory to read ahead when a cold cluster is hit */
+#define FAT_DIR_RA_BYTES	(128 * 1024)
+
+/*
+ * Read ahead the clusters following iblock when its cluster is not cached
+ * yet. The chain is resolved through the cluster cache, so a fragmented
+ * directory still gets one plugged batch instead of a read per cluster.
+ */
+static void fat_dir_readahead(struct inode *dir, sector_t iblock,
+			      sector_t phys)
 {
 	struct super_block *sb = dir->i_sb;
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
 	struct buffer_head *bh;
-	int sec;
+	struct blk_plug plug;
+	unsigned long mapped_blocks;
+	sector_t last_block;
+	bool cold;
+	int i;
 
-	/* This is not a first sector of cluster, or sec_per_clus == 1 */
-	if ((iblock & (sbi->sec_per_clus - 1)) || sbi->sec_per_clus == 1)
+	/* This is not a first sector of cluster */
+	if (iblock & (sbi->sec_per_clus - 1))
 		return;
 	/* root dir of FAT12/FAT16 */
 	if (!is_fat32(sbi) && (dir->i_ino == MSDOS_ROOT_INO))
 		return;
 
+	/* Cached or already being read by an earlier readahead */
 	bh = sb_find_get_block(sb, phys);
-	if (bh == NULL || !buffer_uptodate(bh)) {
-		for (sec = 0; sec < sbi->sec_per_clus; sec++)
-			sb_breadahead(sb, phys + sec);
-	}
+	cold = !bh || (!buffer_uptodate(bh) && !buffer_locked(bh));
 	brelse(bh);
+	if (!cold)
+		return;
+
+	last_block = iblock + max_t(sector_t, sbi->sec_per_clus,
+				    FAT_DIR_RA_BYTES >> sb->s_blocksize_bits);
+	blk_start_plug(&plug);
+	while (iblock < last_block) {
+		if (fat_bmap(dir, iblock, &phys, &mapped_blocks, 0, false) ||
+		    !phys)
+			break;
+		if (mapped_blocks > last_block - iblock)
+			mapped_blocks = last_block - iblock;
+		for (i = 0; i < mapped_blocks; i++)
+			sb_breadahead(sb, phys + i);
+		iblock += mapped_blocks;
+	}
+	blk_finish_plug(&plug);
 }
 
 /* Returns the inode number of the directory entry at offset pos. If bh is
@@ -178,13 +207,70 @@ static int uni16_to_x8(struct super_block *sb, unsigned char *ascii,
 	return op - ascii;
 }
 
+#define FAT_UNI_ASCII_MASK	0xff80ff80ff80ff80ULL
+#define FAT_UNI_LANE_TOP	0x8000800080008000ULL
+#define FAT_UNI_LANE_FILL	0x7fff7fff7fff7fffULL
+
+/* True if the four characters in w are all ASCII and none is the NUL */
+static inline bool fat_uni_ascii4(u64 w)
+{
+	if (w & FAT_UNI_ASCII_MASK)
+		return false;
+	/* Every lane is below 0x80 here, so adding can't carry across lanes */
+	return ((w + FAT_UNI_LANE_FILL) & FAT_UNI_LANE_TOP) == FAT_UNI_LANE_TOP;
+}
+
+/*
+ * Same output as utf16s_to_utf8s(), but ASCII runs, which is what most
+ * long names are made of, are narrowed four characters at a time. Only
+ * the other characters go through the NLS core, one (pair) at a time.
+ */
+static int fat_uni_to_utf8(const wchar_t *uni, unsigned char *buf, int size)
+{
+	const wchar_t *ip = uni, *end = uni + FAT_MAX_UNI_CHARS;
+	unsigned char *op = buf;
+	int n, len;
+
+	while (ip < end && size > 0) {
+		if (end - ip >= 4 && size >= 4 &&
+		    fat_uni_ascii4(get_unaligned((const u64 *)ip))) {
+			op[0] = ip[0];
+			op[1] = ip[1];
+			op[2] = ip[2];
+			op[3] = ip[3];
+			op += 4;
+			ip += 4;
+			size -= 4;
+			continue;
+		}
+		if (!*ip)
+			break;
+		if (*ip < 0x80) {
+			*op++ = *ip++;
+			size--;
+			continue;
+		}
+
+		/* Hand a surrogate pair over as a whole */
+		n = 1;
+		if ((ip[0] & 0xfc00) == 0xd800 && ip + 1 < end &&
+		    (ip[1] & 0xfc00) == 0xdc00)
+			n = 2;
+		len = utf16s_to_utf8s(ip, n, UTF16_HOST_ENDIAN, op, size);
+		op += len;
+		size -= len;
+		ip += n;
+	}
+
+	return op - buf;
+}
+
 static inline int fat_uni_to_x8(struct super_block *sb, const wchar_t *uni,
 				unsigned char *buf, int size)
 {
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
 	if (sbi->options.utf8)
-		return utf16s_to_utf8s(uni, FAT_MAX_UNI_CHARS,
-				UTF16_HOST_ENDIAN, buf, size);
+		return fat_uni_to_utf8(uni, buf, size);
 	else
 		return uni16_to_x8(sb, buf, uni, size, sbi->nls_io);
 }
@@ -458,71 +544,323 @@ static int fat_parse_short(struct super_block *sb,
 }
 
 /*
- * Return values: negative -> error/not found, 0 -> found.
+ * Get the next record of @dir from *pos on: its short entry in *de, and
+ * in *nr_slots the number of long name slots before it, whose name is
+ * in *unicode. Returns -ENOENT at the end of the directory.
  */
-int fat_search_long_prfs(struct inode *inode, const unsigned char *name,
-		    int name_len, struct fat_slot_info *sinfo)
+static int fat_next_record(struct inode *dir, loff_t *pos,
+			   struct buffer_head **bh, struct msdos_dir_entry **de,
+			   wchar_t **unicode, unsigned char *nr_slots)
 {
-	struct super_block *sb = inode->i_sb;
-	struct msdos_sb_info *sbi = MSDOS_SB(sb);
-	struct buffer_head *bh = NULL;
-	struct msdos_dir_entry *de;
-	unsigned char nr_slots;
-	wchar_t *unicode = NULL;
-	unsigned char bufname[FAT_MAX_SHORT_SIZE];
-	loff_t cpos = 0;
-	int err, len;
-
-	//dbg printk(KERN_INFO "fat_search_long_prfs function...\n");
-
-	err = -ENOENT;
 	while (1) {
-		if (fat_get_entry(inode, &cpos, &bh, &de) == -1)
-			goto end_of_dir;
+		if (fat_get_entry(dir, pos, bh, de) == -1)
+			return -ENOENT;
 parse_record:
-		nr_slots = 0;
-		if (de->name[0] == DELETED_FLAG)
+		*nr_slots = 0;
+		if ((*de)->name[0] == DELETED_FLAG)
 			continue;
-		if (de->attr != ATTR_EXT && (de->attr & ATTR_VOLUME))
+		if ((*de)->attr != ATTR_EXT && ((*de)->attr & ATTR_VOLUME))
 			continue;
-		if (de->attr != ATTR_EXT && IS_FREE(de->name))
+		if ((*de)->attr != ATTR_EXT && IS_FREE((*de)->name))
 			continue;
-		if (de->attr == ATTR_EXT) {
-			int status = fat_parse_long(inode, &cpos, &bh, &de,
-						    &unicode, &nr_slots);
+		if ((*de)->attr == ATTR_EXT) {
+			int status = fat_parse_long(dir, pos, bh, de,
+						    unicode, nr_slots);
 			if (status < 0) {
-				err = status;
-				goto end_of_dir;
+				*bh = NULL;	/* released on error */
+				return status;
 			} else if (status == PARSE_INVALID)
 				continue;
 			else if (status == PARSE_NOT_LONGNAME)
 				goto parse_record;
 			else if (status == PARSE_EOF)
-				goto end_of_dir;
+				return -ENOENT;
 		}
+		return 0;
+	}
+}
 
-		/* Never prepend '.' to hidden files here.
-		 * That is done only for msdos mounts (and only when
-		 * 'dotsOK=yes'); if we are executing here, it is in the
-		 * context of a vfat mount.
-		 */
-		len = fat_parse_short(sb, de, bufname, 0);
-		if (len == 0)
+/* The first slot of the record fat_next_record() just returned */
+static inline loff_t fat_record_start(loff_t pos, unsigned char nr_slots)
+{
+	return pos - (nr_slots + 1) * sizeof(struct msdos_dir_entry);
+}
+
+static bool fat_record_match(struct super_block *sb,
+			     const struct msdos_dir_entry *de,
+			     wchar_t *unicode, unsigned char nr_slots,
+			     const unsigned char *name, int name_len)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	unsigned char bufname[FAT_MAX_SHORT_SIZE];
+	int len;
+
+	/* Never prepend '.' to hidden files here.
+	 * That is done only for msdos mounts (and only when
+	 * 'dotsOK=yes'); if we are executing here, it is in the
+	 * context of a vfat mount.
+	 */
+	len = fat_parse_short(sb, de, bufname, 0);
+	if (len == 0)
+		return false;
+
+	/* Compare shortname */
+	if (fat_name_match(sbi, name, name_len, bufname, len))
+		return true;
+
+	if (nr_slots) {
+		void *longname = unicode + FAT_MAX_UNI_CHARS;
+		int size = PATH_MAX - FAT_MAX_UNI_SIZE;
+
+		/* Compare longname */
+		len = fat_uni_to_x8(sb, unicode, longname, size);
+		if (fat_name_match(sbi, name, name_len, longname, len))
+			return true;
+	}
+	return false;
+}
+
+/* Names equal for fat_name_match() hash the same */
+static u32 fat_name_hash(struct msdos_sb_info *sbi,
+			 const unsigned char *name, int len)
+{
+	unsigned long hash = init_name_hash(NULL);
+
+	if (sbi->options.name_check != 's') {
+		while (len--)
+			hash = partial_name_hash(nls_tolower(sbi->nls_io,
+							     *name++), hash);
+	} else {
+		while (len--)
+			hash = partial_name_hash(*name++, hash);
+	}
+	return end_name_hash(hash);
+}
+
+/* The 8.3 names are compared as they are on disk */
+static inline u32 fat_sname_hash(const unsigned char *name)
+{
+	return full_name_hash(NULL, name, MSDOS_NAME);
+}
+
+/* Hash the names of a record for the index. Returns how many, 0 to 2. */
+static int fat_record_hashes(struct super_block *sb,
+			     const struct msdos_dir_entry *de,
+			     wchar_t *unicode, unsigned char nr_slots,
+			     u32 *hashes)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	unsigned char bufname[FAT_MAX_SHORT_SIZE];
+	int len, nr = 0;
+
+	len = fat_parse_short(sb, de, bufname, 0);
+	if (len == 0)
+		return 0;
+	hashes[nr++] = fat_name_hash(sbi, bufname, len);
+
+	if (nr_slots) {
+		void *longname = unicode + FAT_MAX_UNI_CHARS;
+		int size = PATH_MAX - FAT_MAX_UNI_SIZE;
+
+		len = fat_uni_to_x8(sb, unicode, longname, size);
+		hashes[nr] = fat_name_hash(sbi, longname, len);
+		if (hashes[nr] != hashes[0])
+			nr++;
+	}
+	return nr;
+}
+
+/* Directories from this size on get a name index */
+#define FAT_DINDEX_MIN_SIZE	(4 * 1024)
+/* Records with the same name hash checked on disk before a full scan */
+#define FAT_DINDEX_PROBE	8
+
+/*
+ * Index the names and free slots of a large directory, on its first
+ * lookup. Long names are only looked up (and indexed) on vfat.
+ */
+static int fat_dindex_build(struct inode *dir)
+{
+	struct buffer_head *bh = NULL;
+	struct msdos_dir_entry *de;
+	struct fat_dir_index *idx;
+	unsigned char nr_slots;
+	wchar_t *unicode = NULL;
+	loff_t cpos = 0, slot, run = 0;
+	u32 hashes[2];
+	int err = 0, i, nr;
+
+	if (dir->i_size < FAT_DINDEX_MIN_SIZE)
+		return -E2BIG;
+	idx = fat_dindex_alloc(dir->i_size >> MSDOS_DIR_BITS);
+	if (!idx)
+		return -ENOMEM;
+
+	if (MSDOS_SB(dir->i_sb)->options.isvfat) {
+		while (!(err = fat_next_record(dir, &cpos, &bh, &de, &unicode,
+					       &nr_slots))) {
+			nr = fat_record_hashes(dir->i_sb, de, unicode,
+					       nr_slots, hashes);
+			slot = fat_record_start(cpos, nr_slots);
+			for (i = 0; i < nr && !err; i++)
+				err = fat_dindex_insert(idx, hashes[i], slot,
+							false);
+			if (err)
+				break;
+		}
+		if (err != -ENOENT)
+			goto out;
+		err = 0;
+	}
+
+	/* the 8.3 names as fat_get_short_entry() sees them, and the holes */
+	cpos = 0;
+	while (!err && fat_get_entry(dir, &cpos, &bh, &de) >= 0) {
+		slot = cpos - sizeof(*de);
+		if (IS_FREE(de->name))
 			continue;
+		if (run < slot)
+			err = fat_dindex_insert_run(idx, run,
+					(slot - run) >> MSDOS_DIR_BITS);
+		run = cpos;
+		if (!err && !(de->attr & ATTR_VOLUME))
+			err = fat_dindex_insert(idx, fat_sname_hash(de->name),
+						slot, true);
+	}
+	if (!err && run < cpos)
+		err = fat_dindex_insert_run(idx, run,
+					    (cpos - run) >> MSDOS_DIR_BITS);
+out:
+	brelse(bh);
+	if (unicode)
+		__putname(unicode);
+	if (err) {
+		fat_dindex_free(idx);
+		return err;
+	}
+	fat_dindex_attach(dir, idx);
+	return 0;
+}
 
-		/* Compare shortname */
-		if (fat_name_match(sbi, name, name_len, bufname, len))
-			goto found;
+/* The @nr_slots slots at @pos were taken or freed (@free) */
+static void fat_dindex_update_slots(struct inode *dir, loff_t pos,
+				    int nr_slots, bool free)
+{
+	if (fat_dindex_present(dir) &&
+	    fat_dindex_slots(dir, pos, nr_slots, free))
+		fat_dindex_drop(dir);
+}
 
-		if (nr_slots) {
-			void *longname = unicode + FAT_MAX_UNI_CHARS;
-			int size = PATH_MAX - FAT_MAX_UNI_SIZE;
+/* Add (or remove) the names of the record at @slot_off to the index */
+static void fat_dindex_update(struct inode *dir, loff_t slot_off, bool add)
+{
+	struct buffer_head *bh = NULL;
+	struct msdos_dir_entry *de;
+	unsigned char nr_slots;
+	wchar_t *unicode = NULL;
+	loff_t cpos = slot_off;
+	u32 hashes[2];
+	int err, i, nr;
 
-			/* Compare longname */
-			len = fat_uni_to_x8(sb, unicode, longname, size);
-			if (fat_name_match(sbi, name, name_len, longname, len))
-				goto found;
+	if (!fat_dindex_present(dir))
+		return;
+
+	err = fat_next_record(dir, &cpos, &bh, &de, &unicode, &nr_slots);
+	if (!err && fat_record_start(cpos, nr_slots) != slot_off)
+		err = -EIO;
+	if (err)
+		goto out;
+
+	nr = 0;
+	if (MSDOS_SB(dir->i_sb)->options.isvfat)
+		nr = fat_record_hashes(dir->i_sb, de, unicode, nr_slots,
+				       hashes);
+	for (i = 0; i < nr && !err; i++) {
+		if (add)
+			err = fat_dindex_add(dir, hashes[i], slot_off, false);
+		else
+			err = fat_dindex_del(dir, hashes[i], slot_off, false);
+	}
+	if (err)
+		goto out;
+	if (add)
+		err = fat_dindex_add(dir, fat_sname_hash(de->name),
+				     cpos - sizeof(*de), true);
+	else
+		err = fat_dindex_del(dir, fat_sname_hash(de->name),
+				     cpos - sizeof(*de), true);
+out:
+	brelse(bh);
+	if (unicode)
+		__putname(unicode);
+	/* build it again rather than keep an index out of step */
+	if (err)
+		fat_dindex_drop(dir);
+}
+
+/*
+ * Return values: negative -> error/not found, 0 -> found.
+ * Without the directory lock (!@locked), the index is neither built nor
+ * dropped; -EAGAIN then tells the caller to take the lock and search again.
+ */
+static int __fat_search_long(struct inode *inode, const unsigned char *name,
+			     int name_len, struct fat_slot_info *sinfo,
+			     bool locked)
+{
+	struct super_block *sb = inode->i_sb;
+	struct buffer_head *bh = NULL;
+	struct msdos_dir_entry *de;
+	unsigned char nr_slots;
+	wchar_t *unicode = NULL;
+	loff_t slot_offs[FAT_DINDEX_PROBE];
+	loff_t cpos = 0;
+	int err, i, nr;
+	u32 hash;
+
+	//dbg printk(KERN_INFO "fat_search_long_prfs function...\n");
+
+	/* Only the records with a name of the same hash, if indexed */
+	hash = fat_name_hash(MSDOS_SB(sb), name, name_len);
+	nr = fat_dindex_probe(inode, hash, false, slot_offs, FAT_DINDEX_PROBE);
+	if (nr == -ENOENT && !locked && inode->i_size >= FAT_DINDEX_MIN_SIZE)
+		return -EAGAIN;
+	if (nr == -ENOENT && locked && !fat_dindex_build(inode))
+		nr = fat_dindex_probe(inode, hash, false, slot_offs,
+				      FAT_DINDEX_PROBE);
+	for (i = 0; i < nr; i++) {
+		brelse(bh);
+		bh = NULL;
+		cpos = slot_offs[i];
+		err = fat_next_record(inode, &cpos, &bh, &de, &unicode,
+				      &nr_slots);
+		if (err || fat_record_start(cpos, nr_slots) != slot_offs[i]) {
+			/* out of step with the directory */
+			if (!locked) {
+				brelse(bh);
+				err = -EAGAIN;
+				goto end_of_dir;
+			}
+			fat_dindex_drop(inode);
+			nr = -ENOENT;
+			break;
 		}
+		if (fat_record_match(sb, de, unicode, nr_slots, name, name_len))
+			goto found;
+	}
+	brelse(bh);
+	bh = NULL;
+	err = -ENOENT;
+	if (nr >= 0)
+		goto end_of_dir;
+
+	cpos = 0;
+	while (1) {
+		err = fat_next_record(inode, &cpos, &bh, &de, &unicode,
+				      &nr_slots);
+		if (err)
+			goto end_of_dir;
+		if (fat_record_match(sb, de, unicode, nr_slots, name, name_len))
+			goto found;
 	}
 
 found:
@@ -539,8 +877,25 @@ end_of_dir:
 
 	return err;
 }
+
+int fat_search_long_prfs(struct inode *inode, const unsigned char *name,
+		    int name_len, struct fat_slot_info *sinfo)
+{
+	return __fat_search_long(inode, name, name_len, sinfo, true);
+}
 EXPORT_SYMBOL_GPL(fat_search_long_prfs);
 
+/*
+ * For lookup without the directory lock. The caller checks the result
+ * with fat_dir_read_retry(), and searches again locked on -EAGAIN.
+ */
+int fat_search_long_nolock(struct inode *inode, const unsigned char *name,
+			   int name_len, struct fat_slot_info *sinfo)
+{
+	return __fat_search_long(inode, name, name_len, sinfo, false);
+}
+EXPORT_SYMBOL_GPL(fat_search_long_nolock);
+
 struct fat_ioctl_filldir_callback {
 	struct dir_context ctx;
 	void __user *dirent;
@@ -566,14 +921,14 @@ static int __fat_readdir(struct inode *inode, struct file *file,
 	int isvfat = sbi->options.isvfat;
 	const char *fill_name = NULL;
 	int fake_offset = 0;
-	loff_t cpos;
+	loff_t cpos, record;
 	int short_len = 0, fill_len = 0;
+	unsigned int seq = 0;
+	bool locked = false;
 	int ret = 0;
 
 	//dbg printk(KERN_INFO "__fat_readdir function...\n");
 
-	mutex_lock(&sbi->s_lock);
-
 	cpos = ctx->pos;
 	/* Fake . and .. for the root directory. */
 	if (inode->i_ino == MSDOS_ROOT_INO) {
@@ -591,6 +946,10 @@ static int __fat_readdir(struct inode *inode, struct file *file,
 
 	bh = NULL;
 get_new:
+	/* each record is checked against i_dir_seq before it is emitted */
+	record = cpos;
+	if (!locked)
+		seq = fat_dir_read_begin(inode);
 	if (fat_get_entry(inode, &cpos, &bh, &de) == -1)
 		goto end_of_dir;
 parse_record:
@@ -659,6 +1018,15 @@ parse_record:
 	fill_len = short_len;
 
 start_filldir:
+	if (!locked && fat_dir_read_retry(inode, seq)) {
+		/* changed while we parsed it, read it again under the lock */
+		fat_lock_dir(inode);
+		locked = true;
+		brelse(bh);
+		bh = NULL;
+		cpos = record;
+		goto get_new;
+	}
 	ctx->pos = cpos - (nr_slots + 1) * sizeof(struct msdos_dir_entry);
 	if (fake_offset && ctx->pos < 2)
 		ctx->pos = 2;
@@ -698,7 +1066,8 @@ fill_failed:
 	if (unicode)
 		__putname(unicode);
 out:
-	mutex_unlock(&sbi->s_lock);
+	if (locked)
+		fat_unlock_dir(inode);
 
 	return ret;
 }
@@ -966,19 +1335,50 @@ int fat_scan_prfs(struct inode *dir, const unsigned char *name,
 	     struct fat_slot_info *sinfo)
 {
 	struct super_block *sb = dir->i_sb;
+	loff_t slot_offs[FAT_DINDEX_PROBE];
+	u32 hash = fat_sname_hash(name);
+	int i, nr;
 
-	sinfo->slot_off = 0;
 	sinfo->bh = NULL;
+
+	/* Only the entries with an 8.3 name of the same hash, if indexed */
+	nr = fat_dindex_probe(dir, hash, true, slot_offs, FAT_DINDEX_PROBE);
+	if (nr == -ENOENT && !fat_dindex_build(dir))
+		nr = fat_dindex_probe(dir, hash, true, slot_offs,
+				      FAT_DINDEX_PROBE);
+	for (i = 0; i < nr; i++) {
+		brelse(sinfo->bh);
+		sinfo->bh = NULL;
+		sinfo->slot_off = slot_offs[i];
+		if (fat_get_short_entry(dir, &sinfo->slot_off, &sinfo->bh,
+					&sinfo->de) < 0 ||
+		    sinfo->slot_off - sizeof(*sinfo->de) != slot_offs[i]) {
+			/* out of step with the directory */
+			fat_dindex_drop(dir);
+			nr = -ENOENT;
+			break;
+		}
+		if (!strncmp(sinfo->de->name, name, MSDOS_NAME))
+			goto found;
+	}
+	brelse(sinfo->bh);
+	sinfo->bh = NULL;
+	if (nr >= 0)
+		return -ENOENT;
+
+	sinfo->slot_off = 0;
 	while (fat_get_short_entry(dir, &sinfo->slot_off, &sinfo->bh,
 				   &sinfo->de) >= 0) {
-		if (!strncmp(sinfo->de->name, name, MSDOS_NAME)) {
-			sinfo->slot_off -= sizeof(*sinfo->de);
-			sinfo->nr_slots = 1;
-			sinfo->i_pos = fat_make_i_pos(sb, sinfo->bh, sinfo->de);
-			return 0;
-		}
+		if (!strncmp(sinfo->de->name, name, MSDOS_NAME))
+			goto found;
 	}
 	return -ENOENT;
+
+found:
+	sinfo->slot_off -= sizeof(*sinfo->de);
+	sinfo->nr_slots = 1;
+	sinfo->i_pos = fat_make_i_pos(sb, sinfo->bh, sinfo->de);
+	return 0;
 }
 EXPORT_SYMBOL_GPL(fat_scan_prfs);
 
@@ -1049,6 +1449,10 @@ int fat_remove_entries_prfs(struct inode *dir, struct fat_slot_info *sinfo)
 
 	//dbg printk(KERN_INFO "fat_remove_entries_prfs function...\n");
 
+	fat_dir_write_begin(dir);
+	fat_dindex_update(dir, sinfo->slot_off, false);
+	fat_dindex_update_slots(dir, sinfo->slot_off, sinfo->nr_slots, true);
+
 	/*
 	 * First stage: Remove the shortname. By this, the directory
 	 * entry is removed.
@@ -1067,8 +1471,10 @@ int fat_remove_entries_prfs(struct inode *dir, struct fat_slot_info *sinfo)
 	if (IS_DIRSYNC(dir))
 		err = sync_dirty_buffer(bh);
 	brelse(bh);
-	if (err)
+	if (err) {
+		fat_dir_write_end(dir);
 		return err;
+	}
 	inode_inc_iversion(dir);
 
 	if (nr_slots) {
@@ -1083,6 +1489,7 @@ int fat_remove_entries_prfs(struct inode *dir, struct fat_slot_info *sinfo)
 			       "Couldn't remove the long name slots");
 		}
 	}
+	fat_dir_write_end(dir);
 
 	fat_truncate_time_prfs(dir, NULL, S_ATIME|S_MTIME);
 	if (IS_DIRSYNC(dir))
@@ -1296,8 +1703,8 @@ error:
 	return err;
 }
 
-int fat_add_entries_prfs(struct inode *dir, void *slots, int nr_slots,
-		    struct fat_slot_info *sinfo)
+static int __fat_add_entries(struct inode *dir, void *slots, int nr_slots,
+			     struct fat_slot_info *sinfo)
 {
 	struct super_block *sb = dir->i_sb;
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
@@ -1313,7 +1720,9 @@ int fat_add_entries_prfs(struct inode *dir, void *slots, int nr_slots,
 	/* First stage: search free directory entries */
 	free_slots = nr_bhs = 0;
 	bh = prev = NULL;
-	pos = 0;
+	/* from the first hole they fit in, as far as the index knows */
+	if (fat_dindex_find_slots(dir, nr_slots, &pos))
+		pos = 0;
 	err = -ENOSPC;
 	while (fat_get_entry(dir, &pos, &bh, &de) > -1) {
 		/* check the maximum size of directory */
@@ -1409,6 +1818,9 @@ found:
 			dir->i_size = (dir->i_size + sbi->cluster_size - 1)
 				& ~((loff_t)sbi->cluster_size - 1);
 		}
+		fat_dindex_update_slots(dir, dir->i_size,
+			nr_cluster << (sbi->cluster_bits - MSDOS_DIR_BITS),
+			true);
 		dir->i_size += nr_cluster << sbi->cluster_bits;
 		MSDOS_I(dir)->mmu_private += nr_cluster << sbi->cluster_bits;
 	}
@@ -1416,6 +1828,8 @@ found:
 	sinfo->de = de;
 	sinfo->bh = bh;
 	sinfo->i_pos = fat_make_i_pos(sb, sinfo->bh, sinfo->de);
+	fat_dindex_update_slots(dir, pos, sinfo->nr_slots, false);
+	fat_dindex_update(dir, pos, true);
 
 	return 0;
 
@@ -1431,4 +1845,16 @@ error_remove:
 		__fat_remove_entries(dir, pos, free_slots);
 	return err;
 }
+
+int fat_add_entries_prfs(struct inode *dir, void *slots, int nr_slots,
+		    struct fat_slot_info *sinfo)
+{
+	int err;
+
+	fat_dir_write_begin(dir);
+	err = __fat_add_entries(dir, slots, nr_slots, sinfo);
+	fat_dir_write_end(dir);
+
+	return err;
+}
 EXPORT_SYMBOL_GPL(fat_add_entries_prfs);
@@ -0,0 +1,549 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * PRFS written 2023 by E.J. van Veldhuizen
+ *
+ * In-memory name index of large directories.
+ */
+
+#include <linux/slab.h>
+#include <linux/shrinker.h>
+#include "fat_prfs.h"
+
+/*
+ * A large directory gets an index of its names on the first lookup: a
+ * hash table from the hash of each short and long name to the first
+ * slot of its record. The raw 8.3 names of its short entries are in the
+ * same table, marked ->sname, to find an entry by its 8.3 name (and to
+ * see if an alias is taken) without a scan. dir.c keeps the index in
+ * step with every record added or removed and checks each hit against
+ * the entries on disk, so it only has to narrow a lookup down to a few
+ * entries.
+ *
+ * It also keeps the runs of free slots, by position, so that a new
+ * record goes straight to the first hole it fits in, or to the end of
+ * the directory. fat_add_entries_prfs() still checks the slots are free
+ * on disk.
+ *
+ * The index is a cache: it is dropped when the directory is evicted,
+ * when it is found out of step, or by the fat-dindex shrinker, and
+ * built again on the next lookup. ->i_dindex is protected by
+ * ->i_dindex_lock; all changes are made with the directory locked, while
+ * lookups without that lock only probe it.
+ */
+
+/* buckets per name at most, before the table is grown */
+#define FAT_DINDEX_LOAD		4
+#define FAT_DINDEX_MIN_BITS	6
+
+struct fat_dir_index {
+	struct inode *dir;
+	struct list_head list;		/* in fat_dindex_list */
+	struct hlist_head *hash;
+	unsigned int hash_bits;
+	unsigned int nr_names;
+	struct rb_root runs;		/* runs of free slots, by start */
+	bool referenced;		/* looked up since the last shrink */
+};
+
+struct fat_dindex_run {
+	struct rb_node node;
+	u32 start;			/* first free slot */
+	u32 len;
+};
+
+struct fat_dindex_name {
+	struct hlist_node node;
+	u32 hash;
+	u32 slot:31;			/* first slot of the record */
+	u32 sname:1;			/* or the slot of the 8.3 name */
+};
+
+static struct kmem_cache *fat_dindex_cachep;
+
+/* The indexes of all directories, least recently built first */
+static LIST_HEAD(fat_dindex_list);
+static DEFINE_SPINLOCK(fat_dindex_lock);
+static atomic_long_t fat_dindex_count = ATOMIC_LONG_INIT(0);
+
+static struct hlist_head *fat_dindex_table(unsigned int bits, gfp_t gfp)
+{
+	struct hlist_head *hash;
+	unsigned int i;
+
+	hash = kvmalloc_array(1U << bits, sizeof(*hash), gfp);
+	if (hash) {
+		for (i = 0; i < (1U << bits); i++)
+			INIT_HLIST_HEAD(&hash[i]);
+	}
+	return hash;
+}
+
+/* A new index sized for @nr_slots directory entries, not yet attached */
+struct fat_dir_index *fat_dindex_alloc(unsigned int nr_slots)
+{
+	struct fat_dir_index *idx;
+
+	idx = kzalloc(sizeof(*idx), GFP_NOFS);
+	if (!idx)
+		return NULL;
+	idx->hash_bits = max_t(unsigned int, FAT_DINDEX_MIN_BITS,
+			       ilog2(max(nr_slots / FAT_DINDEX_LOAD, 1U)));
+	idx->hash = fat_dindex_table(idx->hash_bits, GFP_NOFS);
+	if (!idx->hash) {
+		kfree(idx);
+		return NULL;
+	}
+	INIT_LIST_HEAD(&idx->list);
+	idx->runs = RB_ROOT;
+	return idx;
+}
+
+void fat_dindex_free(struct fat_dir_index *idx)
+{
+	struct fat_dindex_run *run, *next;
+	struct fat_dindex_name *n;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	for (i = 0; i < (1U << idx->hash_bits); i++) {
+		hlist_for_each_entry_safe(n, tmp, &idx->hash[i], node)
+			kmem_cache_free(fat_dindex_cachep, n);
+	}
+	rbtree_postorder_for_each_entry_safe(run, next, &idx->runs, node)
+		kfree(run);
+	kvfree(idx->hash);
+	kfree(idx);
+}
+
+/* Double the table if it got too loaded, as far as memory allows */
+static void fat_dindex_grow(struct fat_dir_index *idx, gfp_t gfp)
+{
+	unsigned int i, bits = idx->hash_bits + 1;
+	struct hlist_head *hash;
+	struct fat_dindex_name *n;
+	struct hlist_node *tmp;
+
+	if (idx->nr_names <= (FAT_DINDEX_LOAD << idx->hash_bits))
+		return;
+	hash = fat_dindex_table(bits, gfp | __GFP_NOWARN);
+	if (!hash)
+		return;
+	for (i = 0; i < (1U << idx->hash_bits); i++) {
+		hlist_for_each_entry_safe(n, tmp, &idx->hash[i], node) {
+			hlist_del(&n->node);
+			hlist_add_head(&n->node, &hash[hash_32(n->hash, bits)]);
+		}
+	}
+	kvfree(idx->hash);
+	idx->hash = hash;
+	idx->hash_bits = bits;
+}
+
+static void __fat_dindex_insert(struct fat_dir_index *idx,
+				struct fat_dindex_name *n)
+{
+	hlist_add_head(&n->node, &idx->hash[hash_32(n->hash, idx->hash_bits)]);
+	idx->nr_names++;
+}
+
+static struct fat_dindex_name *fat_dindex_name_alloc(u32 hash,
+						     loff_t slot_off,
+						     bool sname)
+{
+	struct fat_dindex_name *n;
+
+	n = kmem_cache_alloc(fat_dindex_cachep, GFP_NOFS);
+	if (n) {
+		n->hash = hash;
+		n->slot = slot_off >> MSDOS_DIR_BITS;
+		n->sname = sname;
+	}
+	return n;
+}
+
+/* Add a name to an index that is being built */
+int fat_dindex_insert(struct fat_dir_index *idx, u32 hash, loff_t slot_off,
+		      bool sname)
+{
+	struct fat_dindex_name *n;
+
+	n = fat_dindex_name_alloc(hash, slot_off, sname);
+	if (!n)
+		return -ENOMEM;
+	__fat_dindex_insert(idx, n);
+	fat_dindex_grow(idx, GFP_NOFS);
+	return 0;
+}
+
+static void fat_dindex_run_insert(struct fat_dir_index *idx,
+				  struct fat_dindex_run *run)
+{
+	struct rb_node **p = &idx->runs.rb_node, *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (run->start < rb_entry(parent, struct fat_dindex_run,
+					  node)->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&run->node, parent, p);
+	rb_insert_color(&run->node, &idx->runs);
+}
+
+/* The last run starting at or before @slot */
+static struct fat_dindex_run *fat_dindex_run_lookup(struct fat_dir_index *idx,
+						    u32 slot)
+{
+	struct rb_node *n = idx->runs.rb_node;
+	struct fat_dindex_run *run, *found = NULL;
+
+	while (n) {
+		run = rb_entry(n, struct fat_dindex_run, node);
+		if (slot < run->start) {
+			n = n->rb_left;
+		} else {
+			found = run;
+			n = n->rb_right;
+		}
+	}
+	return found;
+}
+
+static inline struct fat_dindex_run *fat_dindex_run_next(
+						struct fat_dindex_run *run)
+{
+	struct rb_node *n = rb_next(&run->node);
+
+	return n ? rb_entry(n, struct fat_dindex_run, node) : NULL;
+}
+
+/* Add a run of free slots to an index that is being built */
+int fat_dindex_insert_run(struct fat_dir_index *idx, loff_t pos,
+			  int nr_slots)
+{
+	struct fat_dindex_run *run;
+
+	run = kmalloc(sizeof(*run), GFP_NOFS);
+	if (!run)
+		return -ENOMEM;
+	run->start = pos >> MSDOS_DIR_BITS;
+	run->len = nr_slots;
+	fat_dindex_run_insert(idx, run);
+	return 0;
+}
+
+/* Make @idx the index of @dir */
+void fat_dindex_attach(struct inode *dir, struct fat_dir_index *idx)
+{
+	struct msdos_inode_info *ei = MSDOS_I(dir);
+
+	spin_lock(&ei->i_dindex_lock);
+	if (ei->i_dindex) {
+		spin_unlock(&ei->i_dindex_lock);
+		fat_dindex_free(idx);
+		return;
+	}
+	idx->dir = dir;
+	ei->i_dindex = idx;
+	spin_lock(&fat_dindex_lock);
+	list_add_tail(&idx->list, &fat_dindex_list);
+	atomic_long_add(idx->nr_names, &fat_dindex_count);
+	spin_unlock(&fat_dindex_lock);
+	spin_unlock(&ei->i_dindex_lock);
+}
+
+/* Caller holds ->i_dindex_lock */
+static struct fat_dir_index *fat_dindex_detach(struct msdos_inode_info *ei)
+{
+	struct fat_dir_index *idx = ei->i_dindex;
+
+	if (idx) {
+		ei->i_dindex = NULL;
+		spin_lock(&fat_dindex_lock);
+		list_del_init(&idx->list);
+		atomic_long_sub(idx->nr_names, &fat_dindex_count);
+		spin_unlock(&fat_dindex_lock);
+	}
+	return idx;
+}
+
+void fat_dindex_drop(struct inode *dir)
+{
+	struct msdos_inode_info *ei = MSDOS_I(dir);
+	struct fat_dir_index *idx;
+
+	if (!fat_dindex_present(dir))
+		return;
+	spin_lock(&ei->i_dindex_lock);
+	idx = fat_dindex_detach(ei);
+	spin_unlock(&ei->i_dindex_lock);
+	if (idx)
+		fat_dindex_free(idx);
+}
+
+/*
+ * Get the first slots of the records of @dir that have a name hashing
+ * to @hash (the slots of the 8.3 names with @sname), at most @max of
+ * them. Returns their number, -ENOENT if @dir has no index or
+ * -EOVERFLOW if there are more than @max.
+ */
+int fat_dindex_probe(struct inode *dir, u32 hash, bool sname,
+		     loff_t *slot_offs, int max)
+{
+	struct msdos_inode_info *ei = MSDOS_I(dir);
+	struct fat_dir_index *idx;
+	struct fat_dindex_name *n;
+	int nr = 0;
+
+	spin_lock(&ei->i_dindex_lock);
+	idx = ei->i_dindex;
+	if (!idx) {
+		nr = -ENOENT;
+		goto out;
+	}
+	idx->referenced = true;
+	hlist_for_each_entry(n, &idx->hash[hash_32(hash, idx->hash_bits)],
+			     node) {
+		if (n->hash != hash || n->sname != sname)
+			continue;
+		if (nr == max) {
+			nr = -EOVERFLOW;
+			break;
+		}
+		slot_offs[nr++] = (loff_t)n->slot << MSDOS_DIR_BITS;
+	}
+out:
+	spin_unlock(&ei->i_dindex_lock);
+	return nr;
+}
+
+/* Index a name of the record at @slot_off, if @dir has an index */
+int fat_dindex_add(struct inode *dir, u32 hash, loff_t slot_off, bool sname)
+{
+	struct msdos_inode_info *ei = MSDOS_I(dir);
+	struct fat_dindex_name *n;
+
+	n = fat_dindex_name_alloc(hash, slot_off, sname);
+	if (!n)
+		return -ENOMEM;
+
+	spin_lock(&ei->i_dindex_lock);
+	if (!ei->i_dindex) {
+		spin_unlock(&ei->i_dindex_lock);
+		kmem_cache_free(fat_dindex_cachep, n);
+		return 0;
+	}
+	__fat_dindex_insert(ei->i_dindex, n);
+	fat_dindex_grow(ei->i_dindex, GFP_NOWAIT);
+	atomic_long_inc(&fat_dindex_count);
+	spin_unlock(&ei->i_dindex_lock);
+	return 0;
+}
+
+/*
+ * Forget a name of the record at @slot_off. Returns -ENOENT if @dir has
+ * an index without that name: it is out of step.
+ */
+int fat_dindex_del(struct inode *dir, u32 hash, loff_t slot_off, bool sname)
+{
+	struct msdos_inode_info *ei = MSDOS_I(dir);
+	struct fat_dir_index *idx;
+	struct fat_dindex_name *n;
+	u32 slot = slot_off >> MSDOS_DIR_BITS;
+	int err = 0;
+
+	spin_lock(&ei->i_dindex_lock);
+	idx = ei->i_dindex;
+	if (!idx)
+		goto out;
+	err = -ENOENT;
+	hlist_for_each_entry(n, &idx->hash[hash_32(hash, idx->hash_bits)],
+			     node) {
+		if (n->hash == hash && n->slot == slot && n->sname == sname) {
+			hlist_del(&n->node);
+			idx->nr_names--;
+			atomic_long_dec(&fat_dindex_count);
+			kmem_cache_free(fat_dindex_cachep, n);
+			err = 0;
+			break;
+		}
+	}
+out:
+	spin_unlock(&ei->i_dindex_lock);
+	return err;
+}
+
+static unsigned long fat_dindex_shrink_count(struct shrinker *shrink,
+					     struct shrink_control *sc)
+{
+	return atomic_long_read(&fat_dindex_count);
+}
+
+static unsigned long fat_dindex_shrink_scan(struct shrinker *shrink,
+					    struct shrink_control *sc)
+{
+	struct fat_dir_index *idx, *tmp;
+	struct msdos_inode_info *ei;
+	unsigned long freed = 0;
+	LIST_HEAD(dispose);
+
+	spin_lock(&fat_dindex_lock);
+	list_for_each_entry_safe(idx, tmp, &fat_dindex_list, list) {
+		if (freed >= sc->nr_to_scan)
+			break;
+		ei = MSDOS_I(idx->dir);
+		/* The lock order is i_dindex_lock, then fat_dindex_lock */
+		if (!spin_trylock(&ei->i_dindex_lock))
+			continue;
+		/* a second chance for the indexes in use */
+		if (idx->referenced) {
+			idx->referenced = false;
+			list_move_tail(&idx->list, &fat_dindex_list);
+		} else {
+			ei->i_dindex = NULL;
+			list_move(&idx->list, &dispose);
+			atomic_long_sub(idx->nr_names, &fat_dindex_count);
+			freed += idx->nr_names;
+		}
+		spin_unlock(&ei->i_dindex_lock);
+	}
+	spin_unlock(&fat_dindex_lock);
+
+	list_for_each_entry_safe(idx, tmp, &dispose, list)
+		fat_dindex_free(idx);
+	return freed;
+}
+
+static struct shrinker fat_dindex_shrinker = {
+	.count_objects	= fat_dindex_shrink_count,
+	.scan_objects	= fat_dindex_shrink_scan,
+	.seeks		= DEFAULT_SEEKS,
+};
+
+int __init fat_dindex_init(void)
+{
+	int err;
+
+	fat_dindex_cachep = kmem_cache_create("fat_dindex",
+				sizeof(struct fat_dindex_name),
+				0, SLAB_RECLAIM_ACCOUNT|SLAB_MEM_SPREAD,
+				NULL);
+	if (fat_dindex_cachep == NULL)
+		return -ENOMEM;
+	err = register_shrinker(&fat_dindex_shrinker, "fat-dindex");
+	if (err)
+		kmem_cache_destroy(fat_dindex_cachep);
+	return err;
+}
+
+void fat_dindex_destroy(void)
+{
+	unregister_shrinker(&fat_dindex_shrinker);
+	kmem_cache_destroy(fat_dindex_cachep);
+}
+
+/*
+ * Where to look for @nr_slots free slots in @dir: the first hole they
+ * fit in, else the free slots at the end, else the end. Returns -ENOENT
+ * if @dir has no index.
+ */
+int fat_dindex_find_slots(struct inode *dir, int nr_slots, loff_t *pos)
+{
+	struct msdos_inode_info *ei = MSDOS_I(dir);
+	u32 end = dir->i_size >> MSDOS_DIR_BITS, slot = end;
+	struct fat_dindex_run *run;
+	struct rb_node *n;
+	int err = 0;
+
+	spin_lock(&ei->i_dindex_lock);
+	if (!ei->i_dindex) {
+		err = -ENOENT;
+		goto out;
+	}
+	for (n = rb_first(&ei->i_dindex->runs); n; n = rb_next(n)) {
+		run = rb_entry(n, struct fat_dindex_run, node);
+		if (run->len >= nr_slots || run->start + run->len >= end) {
+			slot = run->start;
+			break;
+		}
+	}
+	*pos = (loff_t)slot << MSDOS_DIR_BITS;
+out:
+	spin_unlock(&ei->i_dindex_lock);
+	return err;
+}
+
+/*
+ * The @nr_slots slots at @pos were taken (@free false) or freed. Returns
+ * -EINVAL if that does not fit the runs of the index: it is out of step.
+ */
+int fat_dindex_slots(struct inode *dir, loff_t pos, int nr_slots, bool free)
+{
+	struct msdos_inode_info *ei = MSDOS_I(dir);
+	u32 start = pos >> MSDOS_DIR_BITS, end = start + nr_slots;
+	struct fat_dindex_run *run, *next, *new;
+	struct fat_dir_index *idx;
+	int err = 0;
+
+	/* a split or a new run needs one more */
+	new = kmalloc(sizeof(*new), GFP_NOFS);
+	if (!new)
+		return -ENOMEM;
+
+	spin_lock(&ei->i_dindex_lock);
+	idx = ei->i_dindex;
+	if (!idx)
+		goto out;
+	run = fat_dindex_run_lookup(idx, start);
+	if (!free) {
+		/* carve [start, end) out of the run holding it */
+		if (!run || run->start + run->len < end) {
+			err = -EINVAL;
+			goto out;
+		}
+		if (run->start + run->len > end) {
+			new->start = end;
+			new->len = run->start + run->len - end;
+			fat_dindex_run_insert(idx, new);
+			new = NULL;
+		}
+		run->len = start - run->start;
+		if (!run->len) {
+			rb_erase(&run->node, &idx->runs);
+			kfree(run);
+		}
+		goto out;
+	}
+
+	next = run ? fat_dindex_run_next(run) : rb_entry_safe(
+			rb_first(&idx->runs), struct fat_dindex_run, node);
+	if ((run && run->start + run->len > start) ||
+	    (next && next->start < end)) {
+		err = -EINVAL;
+		goto out;
+	}
+	if (run && run->start + run->len == start) {
+		/* grow the run before, and merge the one after */
+		run->len += nr_slots;
+		if (next && next->start == end) {
+			run->len += next->len;
+			rb_erase(&next->node, &idx->runs);
+			kfree(next);
+		}
+	} else if (next && next->start == end) {
+		/* the key moves down, but stays between the neighbours */
+		next->start = start;
+		next->len += nr_slots;
+	} else {
+		new->start = start;
+		new->len = nr_slots;
+		fat_dindex_run_insert(idx, new);
+		new = NULL;
+	}
+out:
+	spin_unlock(&ei->i_dindex_lock);
+	kfree(new);
+	return err;
+}
@@ -13,7 +13,11 @@
 #include <linux/buffer_head.h>
 #include <linux/nls.h>
 #include <linux/hash.h>
+#include <linux/list_bl.h>
+#include <linux/rbtree.h>
+#include <linux/completion.h>
 #include <linux/ratelimit.h>
+#include <linux/workqueue.h>
 #include <linux/msdos_fs.h>
 
 /*
@@ -59,11 +63,23 @@ struct fat_mount_options {
 		 tz_set:1,	   /* Filesystem timestamps' offset set */
 		 rodir:1,	   /* allow ATTR_RO for directory */
 		 discard:1,	   /* Issue discard requests on deletions */
+		 delalloc:1,	   /* Allocate clusters at writeback time */
+		 mapahead:1,	   /* Cache the whole cluster map on open */
+		 trustfsinfo:1,	   /* Use FSINFO free count if unmounted cleanly */
+		 iomap:1,	   /* Regular file I/O through iomap */
+		 oldbackups:1,	   /* Flag backups named by older versions */
 		 dos1xfloppy:1;	   /* Assume default BPB for DOS 1.x floppies */
 };
 
+/* clusters per allocation group of the cluster bitmap */
+#define FAT_GROUP_BITS	15
+#define FAT_GROUP_SIZE	(1U << FAT_GROUP_BITS)
+
+/* log2 of the inode hash table sizes, scaled to the cluster count */
 #define FAT_HASH_BITS	8
-#define FAT_HASH_SIZE	(1UL << FAT_HASH_BITS)
+#define FAT_HASH_MAX_BITS	16
+
+struct fat_alloc_group;
 
 /*
  * MS-DOS file system in-core superblock data
@@ -81,12 +97,20 @@ struct msdos_sb_info {
 	unsigned long max_cluster;    /* maximum cluster number */
 	unsigned long root_cluster;   /* first cluster of the root directory */
 	unsigned long fsinfo_sector;  /* sector number of FAT32 fsinfo */
-	struct mutex fat_lock;
+	struct mutex fat_lock;	/* FAT, FSINFO and allocator state */
 	struct mutex nfs_build_inode_lock;
-	struct mutex s_lock;
+	spinlock_t free_lock;	/* free and reserved cluster counts */
 	unsigned int prev_free;      /* previously allocated cluster number */
 	unsigned int free_clusters;  /* -1 if undefined */
 	unsigned int free_clus_valid; /* is free_clusters valid? */
+	unsigned int reserved_clusters; /* promised to delayed allocation */
+	unsigned long *clus_bitmap;  /* in-use clusters, NULL until built */
+	struct fat_alloc_group *groups; /* one per FAT_GROUP_SIZE clusters */
+	unsigned int nr_groups;
+	unsigned int bitmap_scan;    /* clus_bitmap covers the entries below */
+	unsigned int scan_free;      /* free clusters below bitmap_scan */
+	struct task_struct *count_thread; /* background free cluster count */
+	struct completion count_done;
 	struct fat_mount_options options;
 	struct nls_table *nls_disk;   /* Codepage used on disk */
 	struct nls_table *nls_io;     /* Charset used for input and display */
@@ -99,14 +123,32 @@ struct msdos_sb_info {
 	const struct fatent_operations *fatent_ops;
 	struct inode *fat_inode;
 	struct inode *fsinfo_inode;
+	unsigned long *fat_dirty;     /* FAT blocks not yet mirrored */
+
+	struct mutex flush_lock;      /* one disk cache flush at a time */
+	atomic64_t flush_seq;         /* disk cache flushes started */
+	u64 flush_done;               /* last flush completed */
+	int flush_err;                /* and its result */
+
+	spinlock_t close_lock;
+	struct list_head close_list;  /* closed files to write back */
+	struct delayed_work close_work;
+
+	spinlock_t discard_lock;
+	struct rb_root discard_tree;  /* freed runs to discard, by cluster */
+	unsigned int discard_queued;  /* clusters in it */
+	unsigned int discard_seq;     /* discard batches completed */
+	wait_queue_head_t discard_wait;
+	struct delayed_work discard_work;
+	struct super_block *sb;       /* for discard_work */
 
 	struct ratelimit_state ratelimit;
 
-	spinlock_t inode_hash_lock;
-	struct hlist_head inode_hashtable[FAT_HASH_SIZE];
+	unsigned int hash_bits;
+	struct hlist_bl_head *inode_hashtable;	/* by i_pos, bucket locked */
 
 	spinlock_t dir_hash_lock;
-	struct hlist_head dir_hashtable[FAT_HASH_SIZE];
+	struct hlist_head *dir_hashtable;	/* by i_logstart, for NFS */
 
 	unsigned int dirty;           /* fs state before mount */
 	struct rcu_head rcu;
@@ -114,13 +156,33 @@ struct msdos_sb_info {
 
 #define FAT_CACHE_VALID	0	/* special case for valid cache */
 
+/*
+ * PRFS marks backup copies in the directory entry itself: bit 7 of lcase
+ * (unused by Windows NT) flags the backup, the creation time fields hold
+ * the backup time and adate keeps the microseconds below the 10ms
+ * ctime_cs resolution. Other systems show that adate as a bogus access
+ * date (1980) on backups. Backups made before the flag existed get it
+ * on lookup with the "oldbackups" option.
+ */
+#define FAT_PRFS_BACKUP		0x80	/* lcase: PRFS backup copy */
+#define FAT_PRFS_USEC_PER_CS	10000	/* microseconds per ctime_cs tick */
+
+/* how long "flush" gathers closed files before writing them back */
+#define FAT_CLOSE_DELAY		(HZ / 50)
+
+/* FAT blocks remembered per inode for fsync, beyond that the whole FAT */
+#define FAT_FSYNC_BLOCKS	8
+
 /*
  * MS-DOS file system inode data in memory
  */
 struct msdos_inode_info {
 	spinlock_t cache_lru_lock;
 	struct list_head cache_lru;
+	struct rb_root cache_tree;	/* extent caches by file cluster */
+	struct list_head cache_inodes;	/* on the shrinker list if caching */
 	int nr_caches;
+	int cache_full;		/* all extents cached (mapahead), no budget */
 	/* for avoiding the race between fat_free() and fat_get_cluster() */
 	unsigned int cache_valid_id;
 
@@ -131,10 +193,25 @@ struct msdos_inode_info {
 	int i_logstart;		/* logical first cluster */
 	int i_attrs;		/* unused attribute bits */
 	loff_t i_pos;		/* on-disk position of directory entry or 0 */
-	struct hlist_node i_fat_hash;	/* hash by i_location */
+	struct hlist_bl_node i_fat_hash;	/* hash by i_location */
 	struct hlist_node i_dir_hash;	/* hash by i_logstart */
+	struct list_head i_close;	/* on close_list ("flush") */
+	int i_close_again;	/* closed again while on close_list */
+	struct mutex i_dir_lock;	/* serializes directory contents */
+	seqcount_t i_dir_seq;		/* bumped by changes, under i_dir_lock */
+	unsigned int i_dir_writers;	/* nested fat_dir_write_begin() */
+	spinlock_t i_dindex_lock;
+	struct fat_dir_index *i_dindex;	/* name index of a directory */
 	struct rw_semaphore truncate_lock; /* protect bmap against truncate */
+	struct mutex i_da_mutex;	/* protect delayed allocation */
+	int i_reserved;		/* clusters reserved by delayed allocation */
+	/* FAT blocks changed since the last fsync, under i_lock */
+	unsigned int i_fsync_blocks[FAT_FSYNC_BLOCKS];
+	unsigned int i_fsync_nr;
+	bool i_fsync_all;	/* too many, sync the whole FAT */
 	struct timespec64 i_crtime;	/* File creation (birth) time */
+	int i_backup;		/* PRFS backup copy (FAT_PRFS_BACKUP) */
+	u64 i_backup_time;	/* PRFS backup time in ns, if i_backup */
 	struct inode vfs_inode;
 };
 
@@ -184,6 +261,80 @@ static inline struct msdos_inode_info *MSDOS_I(struct inode *inode)
 	return container_of(inode, struct msdos_inode_info, vfs_inode);
 }
 
+/*
+ * Namespace operations lock only the directories they change, so that
+ * operations in different directories run in parallel. Rename takes both
+ * directories in address order; it is the only path taking two, and
+ * cross-directory renames are already serialized by the VFS. The ".." of
+ * a moved directory is rewritten without its own lock: the VFS excludes
+ * rmdir and rename of it, and nothing else writes that entry.
+ */
+static inline void fat_lock_dir(struct inode *dir)
+{
+	mutex_lock(&MSDOS_I(dir)->i_dir_lock);
+}
+
+static inline void fat_unlock_dir(struct inode *dir)
+{
+	mutex_unlock(&MSDOS_I(dir)->i_dir_lock);
+}
+
+static inline void fat_lock_dirs(struct inode *dir1, struct inode *dir2)
+{
+	if (dir1 == dir2) {
+		fat_lock_dir(dir1);
+		return;
+	}
+	if (dir1 > dir2)
+		swap(dir1, dir2);
+	mutex_lock(&MSDOS_I(dir1)->i_dir_lock);
+	mutex_lock_nested(&MSDOS_I(dir2)->i_dir_lock, SINGLE_DEPTH_NESTING);
+}
+
+static inline void fat_unlock_dirs(struct inode *dir1, struct inode *dir2)
+{
+	fat_unlock_dir(dir1);
+	if (dir1 != dir2)
+		fat_unlock_dir(dir2);
+}
+
+/*
+ * Lookup and readdir only read the directory, so they start without
+ * i_dir_lock and check i_dir_seq afterwards. Writers hold i_dir_lock and
+ * may sleep with the count odd, so a reader never waits on it: when it
+ * finds the count odd or moved, it takes i_dir_lock and reads again.
+ * Write sections nest, so that rename can keep the count odd over its
+ * whole change, with the entries added and removed inside.
+ */
+static inline unsigned int fat_dir_read_begin(struct inode *dir)
+{
+	return raw_read_seqcount(&MSDOS_I(dir)->i_dir_seq);
+}
+
+static inline bool fat_dir_read_retry(struct inode *dir, unsigned int seq)
+{
+	return (seq & 1) || read_seqcount_retry(&MSDOS_I(dir)->i_dir_seq, seq);
+}
+
+static inline void fat_dir_write_begin(struct inode *dir)
+{
+	lockdep_assert_held(&MSDOS_I(dir)->i_dir_lock);
+	if (!MSDOS_I(dir)->i_dir_writers++)
+		raw_write_seqcount_begin(&MSDOS_I(dir)->i_dir_seq);
+}
+
+static inline void fat_dir_write_end(struct inode *dir)
+{
+	if (!--MSDOS_I(dir)->i_dir_writers)
+		raw_write_seqcount_end(&MSDOS_I(dir)->i_dir_seq);
+}
+
+/* Is this a PRFS backup copy? */
+static inline int fat_is_backup(struct inode *inode)
+{
+	return MSDOS_I(inode)->i_backup;
+}
+
 /*
  * If ->i_mode can't hold S_IWUGO (i.e. ATTR_RO), we use ->i_attrs to
  * save ATTR_RO instead of ->i_mode.
@@ -269,11 +420,11 @@ static inline loff_t fat_i_pos_read(struct msdos_sb_info *sbi,
 {
 	loff_t i_pos;
 #if BITS_PER_LONG == 32
-	spin_lock(&sbi->inode_hash_lock);
+	spin_lock(&inode->i_lock);
 #endif
 	i_pos = MSDOS_I(inode)->i_pos;
 #if BITS_PER_LONG == 32
-	spin_unlock(&sbi->inode_hash_lock);
+	spin_unlock(&inode->i_lock);
 #endif
 	return i_pos;
 }
@@ -321,8 +472,13 @@ static inline void fatwchar_to16(__u8 *dst, const wchar_t *src, size_t len)
 
 /* fat/cache.c */
 extern void fat_cache_inval_inode(struct inode *inode);
+extern int fat_cache_map_inode(struct inode *inode);
 extern int fat_get_cluster(struct inode *inode, int cluster,
 			   int *fclus, int *dclus);
+extern int fat_get_extent(struct inode *inode, int cluster, int max,
+			  int *dclus, int *len);
+extern int fat_get_extent_cached(struct inode *inode, int cluster, int max,
+				 int *dclus, int *len);
 extern int fat_get_mapped_cluster(struct inode *inode, sector_t sector,
 				  sector_t last_block,
 				  unsigned long *mapped_blocks, sector_t *bmap);
@@ -333,6 +489,9 @@ extern int fat_bmap(struct inode *inode, sector_t sector, sector_t *phys,
 extern const struct file_operations fat_dir_operations;
 extern int fat_search_long_prfs(struct inode *inode, const unsigned char *name,
 			   int name_len, struct fat_slot_info *sinfo);
+extern int fat_search_long_nolock(struct inode *inode,
+				  const unsigned char *name, int name_len,
+				  struct fat_slot_info *sinfo);
 extern int fat_dir_empty_prfs(struct inode *dir);
 extern int fat_subdirs(struct inode *dir);
 extern int fat_scan_prfs(struct inode *dir, const unsigned char *name,
@@ -346,6 +505,34 @@ extern int fat_add_entries_prfs(struct inode *dir, void *slots, int nr_slots,
 			   struct fat_slot_info *sinfo);
 extern int fat_remove_entries_prfs(struct inode *dir, struct fat_slot_info *sinfo);
 
+/* fat/dirindex.c */
+struct fat_dir_index;
+
+static inline bool fat_dindex_present(struct inode *dir)
+{
+	return READ_ONCE(MSDOS_I(dir)->i_dindex) != NULL;
+}
+
+extern struct fat_dir_index *fat_dindex_alloc(unsigned int nr_slots);
+extern void fat_dindex_free(struct fat_dir_index *idx);
+extern int fat_dindex_insert(struct fat_dir_index *idx, u32 hash,
+			     loff_t slot_off, bool sname);
+extern int fat_dindex_insert_run(struct fat_dir_index *idx, loff_t pos,
+				 int nr_slots);
+extern void fat_dindex_attach(struct inode *dir, struct fat_dir_index *idx);
+extern void fat_dindex_drop(struct inode *dir);
+extern int fat_dindex_probe(struct inode *dir, u32 hash, bool sname,
+			    loff_t *slot_offs, int max);
+extern int fat_dindex_add(struct inode *dir, u32 hash, loff_t slot_off,
+			  bool sname);
+extern int fat_dindex_del(struct inode *dir, u32 hash, loff_t slot_off,
+			  bool sname);
+extern int fat_dindex_find_slots(struct inode *dir, int nr_slots, loff_t *pos);
+extern int fat_dindex_slots(struct inode *dir, loff_t pos, int nr_slots,
+			    bool free);
+int fat_dindex_init(void);
+void fat_dindex_destroy(void);
+
 /* fat/fatent.c */
 struct fat_entry {
 	int entry;
@@ -385,18 +572,42 @@ static inline void fatent_brelse(struct fat_entry *fatent)
 	fatent->fat_inode = NULL;
 }
 
+/* Is the count of free clusters known? */
+static inline bool fat_free_valid(struct msdos_sb_info *sbi)
+{
+	return sbi->free_clusters != -1 && sbi->free_clus_valid;
+}
+
+/* Is the free cluster count still running in the background? */
+static inline bool fat_counting(struct msdos_sb_info *sbi)
+{
+	return sbi->count_thread && !completion_done(&sbi->count_done);
+}
+
 static inline bool fat_valid_entry(struct msdos_sb_info *sbi, int entry)
 {
 	return FAT_START_ENT <= entry && entry < sbi->max_cluster;
 }
 
 extern void fat_ent_access_init(struct super_block *sb);
+extern void fat_ent_access_exit(struct super_block *sb);
+extern void fat_discard_work(struct work_struct *work);
+extern void fat_count_start(struct super_block *sb);
+extern int fat_mirror_flush(struct super_block *sb, int wait);
+extern int fat_sync_inode_fat(struct inode *inode);
+extern int fat_ent_walk_chain(struct inode *inode,
+			      void (*actor)(struct inode *, int, int, int, void *),
+			      void *data);
 extern int fat_ent_read(struct inode *inode, struct fat_entry *fatent,
 			int entry);
 extern int fat_ent_write(struct inode *inode, struct fat_entry *fatent,
 			 int new, int wait);
 extern int fat_alloc_clusters(struct inode *inode, int *cluster,
 			      int nr_cluster);
+extern int fat_alloc_chain(struct inode *inode, int nr_cluster, int *first,
+			   bool reserved);
+extern int fat_reserve_clusters(struct super_block *sb, int nr_cluster);
+extern void fat_release_clusters(struct super_block *sb, int nr_cluster);
 extern int fat_free_clusters_prfs(struct inode *inode, int cluster);
 extern int fat_count_free_clusters(struct super_block *sb);
 extern int fat_trim_fs(struct inode *inode, struct fstrim_range *range);
@@ -422,24 +633,54 @@ extern void fat_detach_prfs(struct inode *inode);
 extern struct inode *fat_iget(struct super_block *sb, loff_t i_pos);
 extern struct inode *fat_build_inode_prfs(struct super_block *sb,
 			struct msdos_dir_entry *de, loff_t i_pos);
+extern struct inode *fat_build_inode_nolock(struct super_block *sb,
+			struct msdos_dir_entry *de, loff_t i_pos,
+			struct inode *dir, unsigned int seq);
 extern int fat_sync_inode_prfs(struct inode *inode);
 extern int fat_fill_super_prfs(struct super_block *sb, void *data, int silent,
 			  int isvfat, void (*setup)(struct super_block *));
 extern int fat_fill_inode(struct inode *inode, struct msdos_dir_entry *de);
+extern void fat_set_backup(struct inode *inode, const struct timespec64 *ts);
 
+extern void fat_flush_on_close(struct inode *inode);
 extern int fat_flush_inodes_prfs(struct super_block *sb, struct inode *i1,
 			    struct inode *i2);
-static inline unsigned long fat_dir_hash(int logstart)
+static inline struct hlist_head *fat_dir_hash(struct msdos_sb_info *sbi,
+					     int logstart)
 {
-	return hash_32(logstart, FAT_HASH_BITS);
+	return &sbi->dir_hashtable[hash_32(logstart, sbi->hash_bits)];
 }
 extern int fat_add_cluster(struct inode *inode);
+extern int fat_add_clusters(struct inode *inode, int nr_cluster);
+extern int fat_alloc_delayed(struct inode *inode);
+extern void fat_release_reserved(struct inode *inode, loff_t size);
 
 // prfs
+/* prfs_open_mode() verdicts */
+#define PRFS_OPEN_ALLOW		0	/* open as requested */
+#define PRFS_OPEN_BACKUP	1	/* back the file up before opening */
+#define PRFS_OPEN_DENY		2	/* refuse the open */
+
+extern int file_readwrite(struct file * filp);
 extern int filename_backup(const char * fname);
+extern void prfs_backup_prefix(char * fname, int len,
+			       const struct timespec64 *ts);
+extern void create_backup_filename_trailing(char * fname, int len);
+extern int prfs_open_mode(int prfs_mode, int writing, int backup, int created);
 extern int prfs_make_backup(const char * fname);
 extern int get_prfs_mode(void);
 
+/* fat/iomap.c */
+struct iomap_ops;
+extern const struct iomap_ops fat_iomap_ops;
+extern const struct address_space_operations fat_iomap_aops;
+extern int fat_iomap_expand(struct inode *inode, loff_t pos);
+extern int fat_iomap_truncate_page(struct inode *inode, loff_t from);
+extern ssize_t fat_iomap_write_iter(struct kiocb *iocb, struct iov_iter *from);
+extern ssize_t fat_dio_read_iter(struct kiocb *iocb, struct iov_iter *to);
+extern ssize_t fat_dio_write_iter(struct kiocb *iocb, struct iov_iter *from);
+extern int fat_iomap_mmap(struct file *file, struct vm_area_struct *vma);
+
 /* fat/misc.c */
 extern __printf(3, 4) __cold
 void __fat_fs_error_prfs(struct super_block *sb, int report, const char *fmt, ...);
@@ -476,6 +717,7 @@ extern int fat_truncate_time_prfs(struct inode *inode, struct timespec64 *now,
 extern int fat_update_time_prfs(struct inode *inode, struct timespec64 *now,
 			   int flags);
 extern int fat_sync_bhs(struct buffer_head **bhs, int nr_bhs);
+extern int fat_flush_device(struct super_block *sb);
 
 int fat_cache_init(void);
 void fat_cache_destroy(void);
@@ -179,6 +179,211 @@ static void fat_time_unix2fat_test(struct kunit *test)
 			    "Centisecond mismatch\n");
 }
 
+struct prfs_prefix_testcase {
+	const char *name;
+	struct timespec64 ts;
+	const char *prefix;
+};
+
+static struct prfs_prefix_testcase prefix_test_cases[] = {
+	{
+		.name = "Epoch",
+		.ts = {.tv_sec = 0LL, .tv_nsec = 0L},
+		.prefix = "_0000000000000_",
+	},
+	{
+		.name = "Milliseconds taken from nanoseconds",
+		.ts = {.tv_sec = 1700000000LL, .tv_nsec = 123456789L},
+		.prefix = "_1700000000123_",
+	},
+	{
+		.name = "Sub-millisecond nanoseconds",
+		.ts = {.tv_sec = 1700000000LL, .tv_nsec = 999999L},
+		.prefix = "_1700000000000_",
+	},
+	{
+		.name = "Last nanosecond before rollover",
+		.ts = {.tv_sec = 1700000000LL, .tv_nsec = 999999999L},
+		.prefix = "_1700000000999_",
+	},
+	{
+		.name = "First nanosecond after rollover",
+		.ts = {.tv_sec = 1700000001LL, .tv_nsec = 0L},
+		.prefix = "_1700000001000_",
+	},
+	{
+		.name = "Seconds wider than 10 digits",
+		.ts = {.tv_sec = 12345678901LL, .tv_nsec = 1000000L},
+		.prefix = "_2345678901001_",
+	},
+};
+
+static void prefix_testcase_desc(struct prfs_prefix_testcase *t,
+				 char *desc)
+{
+	strscpy(desc, t->name, KUNIT_PARAM_DESC_SIZE);
+}
+
+KUNIT_ARRAY_PARAM(prfs_prefix, prefix_test_cases, prefix_testcase_desc);
+
+static void prfs_backup_prefix_test(struct kunit *test)
+{
+	char buf[20];
+	struct prfs_prefix_testcase *testcase =
+		(struct prfs_prefix_testcase *)test->param_value;
+
+	prfs_backup_prefix(buf, sizeof(buf), &testcase->ts);
+	KUNIT_EXPECT_STREQ(test, testcase->prefix, buf);
+	KUNIT_EXPECT_EQ(test, filename_backup(buf), 1);
+}
+
+static void prfs_backup_prefix_rollover_test(struct kunit *test)
+{
+	struct timespec64 before = {.tv_sec = 1699999999LL,
+				    .tv_nsec = 999999999L};
+	struct timespec64 after = {.tv_sec = 1700000000LL, .tv_nsec = 0L};
+	char b[20], a[20];
+
+	/* Backups must keep sorting by name across a second boundary. */
+	prfs_backup_prefix(b, sizeof(b), &before);
+	prfs_backup_prefix(a, sizeof(a), &after);
+	KUNIT_EXPECT_LT(test, strcmp(b, a), 0);
+}
+
+static void prfs_backup_prefix_short_buf_test(struct kunit *test)
+{
+	struct timespec64 ts = {.tv_sec = 1700000000LL, .tv_nsec = 0L};
+	char buf[16];
+
+	/* Too small for prefix plus NUL: the buffer is left alone. */
+	memset(buf, 'x', sizeof(buf));
+	prfs_backup_prefix(buf, 15, &ts);
+	KUNIT_EXPECT_EQ(test, buf[0], 'x');
+	KUNIT_EXPECT_EQ(test, buf[14], 'x');
+}
+
+static void prfs_filename_backup_test(struct kunit *test)
+{
+	KUNIT_EXPECT_EQ(test, filename_backup("_1700000000123_"), 1);
+	KUNIT_EXPECT_EQ(test, filename_backup("_1700000000123_notes.txt"), 1);
+	KUNIT_EXPECT_EQ(test, filename_backup("_0000000000000__"), 1);
+
+	/* Shorter than the 15 character prefix. */
+	KUNIT_EXPECT_EQ(test, filename_backup(""), 0);
+	KUNIT_EXPECT_EQ(test, filename_backup("_"), 0);
+	KUNIT_EXPECT_EQ(test, filename_backup("_170000000012_"), 0);
+
+	/* Wrong delimiters or non-digits. */
+	KUNIT_EXPECT_EQ(test, filename_backup("1700000000123_x"), 0);
+	KUNIT_EXPECT_EQ(test, filename_backup("_1700000000123x"), 0);
+	KUNIT_EXPECT_EQ(test, filename_backup("_17000000a0123_"), 0);
+	KUNIT_EXPECT_EQ(test, filename_backup("_170000000/123_"), 0);
+	KUNIT_EXPECT_EQ(test, filename_backup("_170000000:123_"), 0);
+	KUNIT_EXPECT_EQ(test, filename_backup("README.TXT"), 0);
+}
+
+static void prfs_file_readwrite_test(struct kunit *test)
+{
+	struct file filp = {};
+
+	filp.f_flags = O_RDONLY;
+	KUNIT_EXPECT_EQ(test, file_readwrite(&filp), 0);
+	filp.f_flags = O_RDONLY | O_CREAT | O_NOFOLLOW;
+	KUNIT_EXPECT_EQ(test, file_readwrite(&filp), 0);
+	filp.f_flags = O_WRONLY;
+	KUNIT_EXPECT_EQ(test, file_readwrite(&filp), 1);
+	filp.f_flags = O_RDWR;
+	KUNIT_EXPECT_EQ(test, file_readwrite(&filp), 1);
+	filp.f_flags = O_WRONLY | O_CREAT | O_TRUNC;
+	KUNIT_EXPECT_EQ(test, file_readwrite(&filp), 1);
+}
+
+static void prfs_open_mode_test(struct kunit *test)
+{
+	/* PRFS mode: back up existing files, backups are write-once. */
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(0, 0, 0, 0), PRFS_OPEN_ALLOW);
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(0, 0, 1, 0), PRFS_OPEN_ALLOW);
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(0, 1, 0, 0), PRFS_OPEN_BACKUP);
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(0, 1, 0, 1), PRFS_OPEN_ALLOW);
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(0, 1, 1, 0), PRFS_OPEN_DENY);
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(0, 1, 1, 1), PRFS_OPEN_ALLOW);
+
+	/* Read-only mode. */
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(1, 0, 0, 0), PRFS_OPEN_ALLOW);
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(1, 0, 1, 0), PRFS_OPEN_ALLOW);
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(1, 1, 0, 1), PRFS_OPEN_DENY);
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(1, 1, 1, 0), PRFS_OPEN_DENY);
+
+	/* rPRFS mode: only backups are writable. */
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(2, 0, 0, 0), PRFS_OPEN_ALLOW);
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(2, 1, 0, 0), PRFS_OPEN_DENY);
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(2, 1, 0, 1), PRFS_OPEN_DENY);
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(2, 1, 1, 0), PRFS_OPEN_ALLOW);
+
+	/* Unknown modes refuse everything. */
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(3, 0, 0, 0), PRFS_OPEN_DENY);
+	KUNIT_EXPECT_EQ(test, prfs_open_mode(-1, 0, 0, 0), PRFS_OPEN_DENY);
+}
+
+/*
+ * Microbenchmarks: these never fail, they only report the average cost
+ * of one call so rewrites of the name handling can be compared.
+ */
+#define PRFS_BENCH_LOOPS	100000
+
+static void prfs_filename_backup_bench(struct kunit *test)
+{
+	static const char * const names[] = {
+		"_1700000000123_notes.txt", "notes.txt", "_17000000a0123_x",
+	};
+	u64 start, ns;
+	int i, hits = 0;
+
+	start = ktime_get_ns();
+	for (i = 0; i < PRFS_BENCH_LOOPS; i++)
+		hits += filename_backup(READ_ONCE(names[i % 3]));
+	ns = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, hits, (PRFS_BENCH_LOOPS + 2) / 3);
+	kunit_info(test, "filename_backup: %llu ns/call\n",
+		   div_u64(ns, PRFS_BENCH_LOOPS));
+}
+
+static void prfs_backup_prefix_bench(struct kunit *test)
+{
+	struct timespec64 ts = {.tv_sec = 1700000000LL, .tv_nsec = 0L};
+	char buf[20];
+	u64 start, ns;
+	int i;
+
+	start = ktime_get_ns();
+	for (i = 0; i < PRFS_BENCH_LOOPS; i++) {
+		ts.tv_nsec = i * 9973L;
+		prfs_backup_prefix(buf, sizeof(buf), &ts);
+	}
+	ns = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_EQ(test, filename_backup(buf), 1);
+	kunit_info(test, "prfs_backup_prefix: %llu ns/call\n",
+		   div_u64(ns, PRFS_BENCH_LOOPS));
+}
+
+static void prfs_open_mode_bench(struct kunit *test)
+{
+	u64 start, ns;
+	int i, denied = 0;
+
+	start = ktime_get_ns();
+	for (i = 0; i < PRFS_BENCH_LOOPS; i++)
+		denied += prfs_open_mode(i % 3, i & 1, (i >> 1) & 1,
+					 (i >> 2) & 1) == PRFS_OPEN_DENY;
+	ns = ktime_get_ns() - start;
+
+	KUNIT_EXPECT_GT(test, denied, 0);
+	kunit_info(test, "prfs_open_mode: %llu ns/call\n",
+		   div_u64(ns, PRFS_BENCH_LOOPS));
+}
+
 static struct kunit_case fat_test_cases[] = {
 	KUNIT_CASE(fat_checksum_test),
 	KUNIT_CASE_PARAM(fat_time_fat2unix_test, fat_time_gen_params),
@@ -191,6 +396,24 @@ static struct kunit_suite fat_test_suite = {
 	.test_cases = fat_test_cases,
 };
 
-kunit_test_suites(&fat_test_suite);
+static struct kunit_case prfs_test_cases[] = {
+	KUNIT_CASE_PARAM(prfs_backup_prefix_test, prfs_prefix_gen_params),
+	KUNIT_CASE(prfs_backup_prefix_rollover_test),
+	KUNIT_CASE(prfs_backup_prefix_short_buf_test),
+	KUNIT_CASE(prfs_filename_backup_test),
+	KUNIT_CASE(prfs_file_readwrite_test),
+	KUNIT_CASE(prfs_open_mode_test),
+	KUNIT_CASE(prfs_filename_backup_bench),
+	KUNIT_CASE(prfs_backup_prefix_bench),
+	KUNIT_CASE(prfs_open_mode_bench),
+	{},
+};
+
+static struct kunit_suite prfs_test_suite = {
+	.name = "prfs_test",
+	.test_cases = prfs_test_cases,
+};
+
+kunit_test_suites(&fat_test_suite, &prfs_test_suite);
 
 MODULE_LICENSE("GPL v2");
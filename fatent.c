@@ -5,7 +5,11 @@
  * Copyright (C) 2004, OGAWA Hirofumi
  */
 
+#include <linux/slab.h>
+#include <linux/kthread.h>
+#include <linux/sched/task.h>
 #include <linux/blkdev.h>
+#include <linux/bio.h>
 #include <linux/sched/signal.h>
 #include <linux/backing-dev-defs.h>
 #include "fat_prfs.h"
@@ -295,6 +299,7 @@ void fat_ent_access_init(struct super_block *sb)
 	//printk(KERN_INFO "fat_ent_access_init function...\n");
 
 	mutex_init(&sbi->fat_lock);
+	spin_lock_init(&sbi->free_lock);
 
 	if (is_fat32(sbi)) {
 		sbi->fatent_shift = 2;
@@ -308,6 +313,11 @@ void fat_ent_access_init(struct super_block *sb)
 	} else {
 		fat_fs_error(sb, "invalid FAT variant, %u bits", sbi->fat_bits);
 	}
+
+	/* Without it the mirror FATs are just written at once */
+	if (sbi->fats > 1)
+		sbi->fat_dirty = kvcalloc(BITS_TO_LONGS(sbi->fat_length),
+					  sizeof(long), GFP_KERNEL);
 }
 
 static void mark_fsinfo_dirty(struct super_block *sb)
@@ -379,8 +389,8 @@ int fat_ent_read(struct inode *inode, struct fat_entry *fatent, int entry)
 }
 
 /* FIXME: We can write the blocks as more big chunk. */
-static int fat_mirror_bhs(struct super_block *sb, struct buffer_head **bhs,
-			  int nr_bhs)
+static int fat_copy_mirrors(struct super_block *sb, struct buffer_head **bhs,
+			    int nr_bhs)
 {
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
 	struct buffer_head *c_bh;
@@ -413,16 +423,160 @@ error:
 	return err;
 }
 
+/*
+ * The other FATs are updated lazily: the FAT blocks written are marked
+ * in ->fat_dirty and fat_mirror_flush() copies them once per writeback
+ * or sync, so a burst of allocations rewrites each mirror block once.
+ * SB_SYNCHRONOUS mounts, or no memory for the bitmap, mirror at once.
+ */
+static int fat_mirror_bhs(struct super_block *sb, struct buffer_head **bhs,
+			  int nr_bhs)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	bool queued = false;
+	int n;
+
+	if (!sbi->fat_dirty || (sb->s_flags & SB_SYNCHRONOUS))
+		return fat_copy_mirrors(sb, bhs, nr_bhs);
+
+	for (n = 0; n < nr_bhs; n++) {
+		if (!test_and_set_bit(bhs[n]->b_blocknr - sbi->fat_start,
+				      sbi->fat_dirty))
+			queued = true;
+	}
+	/* writeback of the FSINFO inode flushes the mirrors */
+	if (queued)
+		__mark_inode_dirty(sbi->fsinfo_inode, I_DIRTY_SYNC);
+	return 0;
+}
+
+/*
+ * Copy the FAT blocks marked in ->fat_dirty to the other FATs. With
+ * @wait the first FAT is written out before its copies are dirtied, so
+ * the mirrors on disk never get ahead of the FAT they back up.
+ */
+int fat_mirror_flush(struct super_block *sb, int wait)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct buffer_head *bh;
+	unsigned long n;
+	int err = 0;
+
+	if (!sbi->fat_dirty)
+		return 0;
+
+	lock_fat(sbi);
+	if (find_first_bit(sbi->fat_dirty, sbi->fat_length) >= sbi->fat_length)
+		goto out;
+	if (wait) {
+		err = sync_mapping_buffers(sbi->fat_inode->i_mapping);
+		if (err)
+			goto out;
+	}
+	for_each_set_bit(n, sbi->fat_dirty, sbi->fat_length) {
+		/* a block written while it is copied is queued again */
+		clear_bit(n, sbi->fat_dirty);
+		smp_mb__after_atomic();
+		bh = sb_bread(sb, sbi->fat_start + n);
+		if (!bh) {
+			fat_msg(sb, KERN_ERR, "FAT block %lu unreadable, "
+				"mirrors not updated", n);
+			set_bit(n, sbi->fat_dirty);
+			err = -EIO;
+			break;
+		}
+		err = fat_copy_mirrors(sb, &bh, 1);
+		brelse(bh);
+		if (err) {
+			set_bit(n, sbi->fat_dirty);
+			break;
+		}
+	}
+out:
+	unlock_fat(sbi);
+	return err;
+}
+
+/* Remember the FAT block @bh for the next fsync of @inode */
+static void fat_fsync_track(struct inode *inode, struct buffer_head *bh)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(inode->i_sb);
+	struct msdos_inode_info *ei = MSDOS_I(inode);
+	unsigned int block = bh->b_blocknr - sbi->fat_start;
+	int i;
+
+	if (READ_ONCE(ei->i_fsync_all))
+		return;
+	spin_lock(&inode->i_lock);
+	for (i = 0; i < ei->i_fsync_nr; i++) {
+		if (ei->i_fsync_blocks[i] == block)
+			goto out;
+	}
+	if (ei->i_fsync_nr < FAT_FSYNC_BLOCKS)
+		ei->i_fsync_blocks[ei->i_fsync_nr++] = block;
+	else
+		ei->i_fsync_all = true;
+out:
+	spin_unlock(&inode->i_lock);
+}
+
+/*
+ * Write out the FAT blocks that @inode changed since its last fsync, or
+ * the whole FAT if it changed too many of them.
+ */
+int fat_sync_inode_fat(struct inode *inode)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct msdos_inode_info *ei = MSDOS_I(inode);
+	struct buffer_head *bhs[FAT_FSYNC_BLOCKS];
+	unsigned int blocks[FAT_FSYNC_BLOCKS];
+	int i, nr, nr_bhs = 0, err;
+	bool all;
+
+	spin_lock(&inode->i_lock);
+	nr = ei->i_fsync_nr;
+	all = ei->i_fsync_all;
+	memcpy(blocks, ei->i_fsync_blocks, nr * sizeof(blocks[0]));
+	ei->i_fsync_nr = 0;
+	ei->i_fsync_all = false;
+	spin_unlock(&inode->i_lock);
+
+	if (all) {
+		err = sync_mapping_buffers(sbi->fat_inode->i_mapping);
+		goto out;
+	}
+
+	/* A block no longer cached was written out before */
+	for (i = 0; i < nr; i++) {
+		bhs[nr_bhs] = sb_find_get_block(sb, sbi->fat_start + blocks[i]);
+		if (bhs[nr_bhs])
+			nr_bhs++;
+	}
+	err = fat_sync_bhs(bhs, nr_bhs);
+	for (i = 0; i < nr_bhs; i++)
+		brelse(bhs[i]);
+out:
+	if (err) {
+		spin_lock(&inode->i_lock);
+		ei->i_fsync_all = true;
+		spin_unlock(&inode->i_lock);
+	}
+	return err;
+}
+
 int fat_ent_write(struct inode *inode, struct fat_entry *fatent,
 		  int new, int wait)
 {
 	struct super_block *sb = inode->i_sb;
 	const struct fatent_operations *ops = MSDOS_SB(sb)->fatent_ops;
-	int err;
+	int n, err;
 
 	//dbg printk(KERN_INFO "fat_ent_write function...\n");
 
 	ops->ent_put(fatent, new);
+	for (n = 0; n < fatent->nr_bhs; n++)
+		fat_fsync_track(inode, fatent->bhs[n]);
 	if (wait) {
 		err = fat_sync_bhs(fatent->bhs, fatent->nr_bhs);
 		if (err)
@@ -455,196 +609,106 @@ static inline int fat_ent_read_block(struct super_block *sb,
 	return ops->ent_bread(sb, fatent, offset, blocknr);
 }
 
-static void fat_collect_bhs(struct buffer_head **bhs, int *nr_bhs,
-			    struct fat_entry *fatent)
-{
-	int n, i;
+/*
+ * Word-at-a-time scanning of FAT16/FAT32 blocks for the whole-FAT scans.
+ * A 64-bit load holds 4 FAT16 or 2 FAT32 entries; their free (zero)
+ * lanes are found with ~(((x & low) + low) | x | low), "low" being all
+ * but the top bit of each lane, which sets the top bit of exactly the
+ * zero lanes and never carries into the next lane. FAT12 entries
+ * straddle bytes and still go through ->ent_get().
+ */
+#define FAT16_LANE_LOW	0x7fff7fff7fff7fffULL
+#define FAT32_LANE_LOW	0x7fffffff7fffffffULL
+#define FAT32_ENT_MASK	0x0fffffff0fffffffULL
+
+struct fat_wordscan {
+	const u8 *data;		/* the FAT block */
+	unsigned int first;	/* entry at the start of the block */
+	unsigned int next;	/* next entry to scan */
+	unsigned int end;	/* end of the scan in this block */
+};
 
-	for (n = 0; n < fatent->nr_bhs; n++) {
-		for (i = 0; i < *nr_bhs; i++) {
-			if (fatent->bhs[n] == bhs[i])
-				break;
-		}
-		if (i == *nr_bhs) {
-			get_bh(fatent->bhs[n]);
-			bhs[i] = fatent->bhs[n];
-			(*nr_bhs)++;
-		}
-	}
+static inline bool fat_wordscan_ok(struct msdos_sb_info *sbi)
+{
+	return sbi->fat_bits != 12;
 }
 
-int fat_alloc_clusters(struct inode *inode, int *cluster, int nr_cluster)
+static inline u64 fat_zero_lanes(u64 x, u64 low)
 {
-	struct super_block *sb = inode->i_sb;
-	struct msdos_sb_info *sbi = MSDOS_SB(sb);
-	const struct fatent_operations *ops = sbi->fatent_ops;
-	struct fat_entry fatent, prev_ent;
-	struct buffer_head *bhs[MAX_BUF_PER_PAGE];
-	int i, count, err, nr_bhs, idx_clus;
-
-	BUG_ON(nr_cluster > (MAX_BUF_PER_PAGE / 2));	/* fixed limit */
-
-	lock_fat(sbi);
-	if (sbi->free_clusters != -1 && sbi->free_clus_valid &&
-	    sbi->free_clusters < nr_cluster) {
-		unlock_fat(sbi);
-		return -ENOSPC;
-	}
-
-	err = nr_bhs = idx_clus = 0;
-	count = FAT_START_ENT;
-	fatent_init(&prev_ent);
-	fatent_init(&fatent);
-	fatent_set_entry(&fatent, sbi->prev_free + 1);
-	while (count < sbi->max_cluster) {
-		if (fatent.entry >= sbi->max_cluster)
-			fatent.entry = FAT_START_ENT;
-		fatent_set_entry(&fatent, fatent.entry);
-		err = fat_ent_read_block(sb, &fatent);
-		if (err)
-			goto out;
-
-		/* Find the free entries in a block */
-		do {
-			if (ops->ent_get(&fatent) == FAT_ENT_FREE) {
-				int entry = fatent.entry;
-
-				/* make the cluster chain */
-				ops->ent_put(&fatent, FAT_ENT_EOF);
-				if (prev_ent.nr_bhs)
-					ops->ent_put(&prev_ent, entry);
-
-				fat_collect_bhs(bhs, &nr_bhs, &fatent);
-
-				sbi->prev_free = entry;
-				if (sbi->free_clusters != -1)
-					sbi->free_clusters--;
-
-				cluster[idx_clus] = entry;
-				idx_clus++;
-				if (idx_clus == nr_cluster)
-					goto out;
+	return ~(((x & low) + low) | x | low);
+}
 
-				/*
-				 * fat_collect_bhs() gets ref-count of bhs,
-				 * so we can still use the prev_ent.
-				 */
-				prev_ent = fatent;
-			}
-			count++;
-			if (count == sbi->max_cluster)
-				break;
-		} while (fat_ent_next(sbi, &fatent));
+/* A bit for each free entry of the BITS_PER_LONG entries at @p */
+static unsigned long fat16_free_word(const __le64 *p)
+{
+	unsigned long free = 0;
+	u64 y;
+	int i;
+
+	for (i = 0; i < BITS_PER_LONG / 4; i++) {
+		y = fat_zero_lanes(le64_to_cpu(p[i]), FAT16_LANE_LOW);
+		free |= (unsigned long)((y >> 15 & 1) | (y >> 30 & 2) |
+					(y >> 45 & 4) | (y >> 60 & 8)) << (i * 4);
 	}
+	return free;
+}
 
-	/* Couldn't allocate the free entries */
-	sbi->free_clusters = 0;
-	sbi->free_clus_valid = 1;
-	err = -ENOSPC;
-
-out:
-	unlock_fat(sbi);
-	mark_fsinfo_dirty(sb);
-	fatent_brelse(&fatent);
-	if (!err) {
-		if (inode_needs_sync(inode))
-			err = fat_sync_bhs(bhs, nr_bhs);
-		if (!err)
-			err = fat_mirror_bhs(sb, bhs, nr_bhs);
+static unsigned long fat32_free_word(const __le64 *p)
+{
+	unsigned long free = 0;
+	u64 y;
+	int i;
+
+	for (i = 0; i < BITS_PER_LONG / 2; i++) {
+		y = fat_zero_lanes(le64_to_cpu(p[i]) & FAT32_ENT_MASK,
+				   FAT32_LANE_LOW);
+		free |= (unsigned long)((y >> 31 & 1) | (y >> 62 & 2)) << (i * 2);
 	}
-	for (i = 0; i < nr_bhs; i++)
-		brelse(bhs[i]);
-
-	if (err && idx_clus)
-		fat_free_clusters_prfs(inode, cluster[0]);
-
-	return err;
+	return free;
 }
 
-int fat_free_clusters_prfs(struct inode *inode, int cluster)
+/*
+ * Scan the block read into @fatent, from fatent->entry up to the end of
+ * the block or @limit. The caller continues at ws->end afterwards.
+ */
+static void fat_wordscan_init(struct msdos_sb_info *sbi,
+			      struct fat_wordscan *ws,
+			      struct fat_entry *fatent, unsigned int limit)
 {
-	struct super_block *sb = inode->i_sb;
-	struct msdos_sb_info *sbi = MSDOS_SB(sb);
-	const struct fatent_operations *ops = sbi->fatent_ops;
-	struct fat_entry fatent;
-	struct buffer_head *bhs[MAX_BUF_PER_PAGE];
-	int i, err, nr_bhs;
-	int first_cl = cluster, dirty_fsinfo = 0;
-
-	//dbg printk(KERN_INFO "fat_free_clusters_prfs function...\n");
-
-	nr_bhs = 0;
-	fatent_init(&fatent);
-	lock_fat(sbi);
-	do {
-		cluster = fat_ent_read(inode, &fatent, cluster);
-		if (cluster < 0) {
-			err = cluster;
-			goto error;
-		} else if (cluster == FAT_ENT_FREE) {
-			fat_fs_error(sb, "%s: deleting FAT entry beyond EOF",
-				     __func__);
-			err = -EIO;
-			goto error;
-		}
-
-		if (sbi->options.discard) {
-			/*
-			 * Issue discard for the sectors we no longer
-			 * care about, batching contiguous clusters
-			 * into one request
-			 */
-			if (cluster != fatent.entry + 1) {
-				int nr_clus = fatent.entry - first_cl + 1;
+	unsigned int epb = fatent->bhs[0]->b_size >> sbi->fatent_shift;
 
-				sb_issue_discard(sb,
-					fat_clus_to_blknr(sbi, first_cl),
-					nr_clus * sbi->sec_per_clus,
-					GFP_NOFS, 0);
-
-				first_cl = cluster;
-			}
-		}
-
-		ops->ent_put(&fatent, FAT_ENT_FREE);
-		if (sbi->free_clusters != -1) {
-			sbi->free_clusters++;
-			dirty_fsinfo = 1;
-		}
-
-		if (nr_bhs + fatent.nr_bhs > MAX_BUF_PER_PAGE) {
-			if (sb->s_flags & SB_SYNCHRONOUS) {
-				err = fat_sync_bhs(bhs, nr_bhs);
-				if (err)
-					goto error;
-			}
-			err = fat_mirror_bhs(sb, bhs, nr_bhs);
-			if (err)
-				goto error;
-			for (i = 0; i < nr_bhs; i++)
-				brelse(bhs[i]);
-			nr_bhs = 0;
-		}
-		fat_collect_bhs(bhs, &nr_bhs, &fatent);
-	} while (cluster != FAT_ENT_EOF);
-
-	if (sb->s_flags & SB_SYNCHRONOUS) {
-		err = fat_sync_bhs(bhs, nr_bhs);
-		if (err)
-			goto error;
-	}
-	err = fat_mirror_bhs(sb, bhs, nr_bhs);
-error:
-	fatent_brelse(&fatent);
-	for (i = 0; i < nr_bhs; i++)
-		brelse(bhs[i]);
-	unlock_fat(sbi);
-	if (dirty_fsinfo)
-		mark_fsinfo_dirty(sb);
+	ws->data = fatent->bhs[0]->b_data;
+	ws->first = fatent->entry & ~(epb - 1);
+	ws->next = fatent->entry;
+	ws->end = min(ws->first + epb, limit);
+}
 
-	return err;
+/*
+ * Get the next word of entries: the entry of bit 0 in *base, the free
+ * entries in *free and the entries inside the scan in *mask.
+ */
+static bool fat_wordscan_next(struct msdos_sb_info *sbi,
+			      struct fat_wordscan *ws, unsigned int *base,
+			      unsigned long *free, unsigned long *mask)
+{
+	unsigned int w = round_down(ws->next, BITS_PER_LONG);
+	const __le64 *p;
+
+	if (ws->next >= ws->end)
+		return false;
+
+	p = (const __le64 *)(ws->data + ((w - ws->first) << sbi->fatent_shift));
+	*mask = BITMAP_FIRST_WORD_MASK(ws->next);
+	if (ws->end - w < BITS_PER_LONG)
+		*mask &= BITMAP_LAST_WORD_MASK(ws->end - w);
+	if (sbi->fat_bits == 32)
+		*free = fat32_free_word(p) & *mask;
+	else
+		*free = fat16_free_word(p) & *mask;
+	*base = w;
+	ws->next = w + BITS_PER_LONG;
+	return true;
 }
-EXPORT_SYMBOL_GPL(fat_free_clusters_prfs);
 
 struct fatent_ra {
 	sector_t cur;
@@ -725,65 +789,1558 @@ static void fat_ent_reada(struct super_block *sb, struct fatent_ra *ra,
 	ra->cur++;
 }
 
-int fat_count_free_clusters(struct super_block *sb)
+/*
+ * Walk the whole cluster chain of @inode and call @actor for each extent
+ * (run of contiguous clusters) of it. The FAT is read ahead for as long
+ * as the chain moves forward block by block, and the window restarts
+ * where the chain jumps.
+ */
+int fat_ent_walk_chain(struct inode *inode,
+		       void (*actor)(struct inode *, int, int, int, void *),
+		       void *data)
 {
+	struct super_block *sb = inode->i_sb;
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
 	const struct fatent_operations *ops = sbi->fatent_ops;
+	const int limit = sb->s_maxbytes >> sbi->cluster_bits;
 	struct fat_entry fatent;
 	struct fatent_ra fatent_ra;
-	int err = 0, free;
+	sector_t blocknr, prev_blocknr = 0;
+	int offset, fclus, dclus, next, start_fclus, start_dclus, err = 0;
 
-	lock_fat(sbi);
-	if (sbi->free_clusters != -1 && sbi->free_clus_valid)
-		goto out;
+	dclus = MSDOS_I(inode)->i_start;
+	if (!dclus)
+		return 0;
 
-	free = 0;
 	fatent_init(&fatent);
-	fatent_set_entry(&fatent, FAT_START_ENT);
-	fat_ra_init(sb, &fatent_ra, &fatent, sbi->max_cluster);
-	while (fatent.entry < sbi->max_cluster) {
-		/* readahead of fat blocks */
-		fat_ent_reada(sb, &fatent_ra, &fatent);
+	fclus = start_fclus = 0;
+	start_dclus = dclus;
+	for (;;) {
+		if (!fat_valid_entry(sbi, dclus) || fclus > limit) {
+			fat_fs_error(sb, "%s: invalid cluster chain (i_pos %lld)",
+				     __func__, MSDOS_I(inode)->i_pos);
+			err = -EIO;
+			break;
+		}
 
-		err = fat_ent_read_block(sb, &fatent);
-		if (err)
-			goto out;
+		ops->ent_blocknr(sb, dclus, &offset, &blocknr);
+		if (blocknr != prev_blocknr) {
+			fatent.entry = dclus;
+			if (!prev_blocknr || blocknr != prev_blocknr + 1)
+				fat_ra_init(sb, &fatent_ra, &fatent,
+					    sbi->max_cluster);
+			fat_ent_reada(sb, &fatent_ra, &fatent);
+			prev_blocknr = blocknr;
+			cond_resched();
+		}
 
-		do {
-			if (ops->ent_get(&fatent) == FAT_ENT_FREE)
-				free++;
-		} while (fat_ent_next(sbi, &fatent));
-		cond_resched();
+		next = fat_ent_read(inode, &fatent, dclus);
+		if (next < 0) {
+			err = next;
+			break;
+		} else if (next == FAT_ENT_FREE) {
+			fat_fs_error(sb, "%s: invalid cluster chain (i_pos %lld)",
+				     __func__, MSDOS_I(inode)->i_pos);
+			err = -EIO;
+			break;
+		}
+		if (next == FAT_ENT_EOF || next != dclus + 1) {
+			actor(inode, start_fclus, start_dclus,
+			      fclus - start_fclus, data);
+			if (next == FAT_ENT_EOF)
+				break;
+			start_fclus = fclus + 1;
+			start_dclus = next;
+		}
+		fclus++;
+		dclus = next;
 	}
-	sbi->free_clusters = free;
-	sbi->free_clus_valid = 1;
-	mark_fsinfo_dirty(sb);
 	fatent_brelse(&fatent);
-out:
-	unlock_fat(sbi);
 	return err;
 }
 
-static int fat_trim_clusters(struct super_block *sb, u32 clus, u32 nr_clus)
+/*
+ * Allocation groups: the data area is cut in groups of FAT_GROUP_SIZE
+ * clusters, whose FAT entries fill whole FAT blocks, and each group has
+ * its own lock, free count, next-fit cursor and free extent trees. Once
+ * the bitmap is complete, allocating and freeing take only the lock of
+ * the group they work in, one group at a time, and ->free_lock for the
+ * counters. Until then ->fat_lock is held across them instead, as free
+ * clusters are found by reading the FAT. Lock order: fat_lock, group
+ * lock, free_lock.
+ */
+struct fat_alloc_group {
+	struct mutex lock;
+	unsigned int free;		/* free clusters, once scanned */
+	unsigned int cursor;		/* where small allocations go on */
+	struct rb_root free_by_start;	/* free extents by first cluster */
+	struct rb_root free_by_len;	/* free extents by length */
+	bool ext_valid;			/* are the free extent trees valid? */
+};
+
+static inline struct fat_alloc_group *fat_group(struct msdos_sb_info *sbi,
+						unsigned int entry)
 {
-	struct msdos_sb_info *sbi = MSDOS_SB(sb);
-	return sb_issue_discard(sb, fat_clus_to_blknr(sbi, clus),
-				nr_clus * sbi->sec_per_clus, GFP_NOFS, 0);
+	return &sbi->groups[entry >> FAT_GROUP_BITS];
 }
 
-int fat_trim_fs(struct inode *inode, struct fstrim_range *range)
+static inline unsigned int fat_group_start(struct msdos_sb_info *sbi,
+					   struct fat_alloc_group *grp)
 {
-	struct super_block *sb = inode->i_sb;
-	struct msdos_sb_info *sbi = MSDOS_SB(sb);
-	const struct fatent_operations *ops = sbi->fatent_ops;
-	struct fat_entry fatent;
-	struct fatent_ra fatent_ra;
-	u64 ent_start, ent_end, minlen, trimmed = 0;
-	u32 free = 0;
-	int err = 0;
+	return max_t(unsigned int, (grp - sbi->groups) << FAT_GROUP_BITS,
+		     FAT_START_ENT);
+}
 
-	/*
-	 * FAT data is organized as clusters, trim at the granulary of cluster.
+static inline unsigned int fat_group_end(struct msdos_sb_info *sbi,
+					 struct fat_alloc_group *grp)
+{
+	return min_t(unsigned long, sbi->max_cluster,
+		     (unsigned long)(grp - sbi->groups + 1) << FAT_GROUP_BITS);
+}
+
+/*
+ * Free extent trees: the free runs of at least FAT_EXTENT_MIN clusters
+ * in a group, indexed by first cluster (to split and merge them) and by
+ * length (for best fit). Shorter holes only live in the bitmap and are
+ * handed out first-fit to small requests. The trees are built with the
+ * bitmap; if an extent can't be allocated, the trees of its group are
+ * dropped and allocation there goes by the bitmap alone.
+ */
+#define FAT_EXTENT_MIN	8
+
+struct fat_free_extent {
+	struct rb_node rb_start;
+	struct rb_node rb_len;
+	unsigned int start;
+	unsigned int len;
+};
+
+static void fat_ext_destroy(struct fat_alloc_group *grp)
+{
+	struct fat_free_extent *ext, *n;
+
+	rbtree_postorder_for_each_entry_safe(ext, n, &grp->free_by_start,
+					     rb_start)
+		kfree(ext);
+	grp->free_by_start = RB_ROOT;
+	grp->free_by_len = RB_ROOT;
+	grp->ext_valid = false;
+}
+
+static void fat_ext_insert(struct fat_alloc_group *grp, unsigned int start,
+			   unsigned int len)
+{
+	struct rb_node **p, *parent;
+	struct fat_free_extent *ext, *e;
+
+	if (!grp->ext_valid || len < FAT_EXTENT_MIN)
+		return;
+	ext = kmalloc(sizeof(*ext), GFP_NOFS);
+	if (!ext) {
+		fat_ext_destroy(grp);
+		return;
+	}
+	ext->start = start;
+	ext->len = len;
+
+	p = &grp->free_by_start.rb_node;
+	parent = NULL;
+	while (*p) {
+		parent = *p;
+		e = rb_entry(parent, struct fat_free_extent, rb_start);
+		if (start < e->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&ext->rb_start, parent, p);
+	rb_insert_color(&ext->rb_start, &grp->free_by_start);
+
+	p = &grp->free_by_len.rb_node;
+	parent = NULL;
+	while (*p) {
+		parent = *p;
+		e = rb_entry(parent, struct fat_free_extent, rb_len);
+		if (len < e->len || (len == e->len && start < e->start))
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&ext->rb_len, parent, p);
+	rb_insert_color(&ext->rb_len, &grp->free_by_len);
+}
+
+static void fat_ext_remove(struct fat_alloc_group *grp,
+			   struct fat_free_extent *ext)
+{
+	rb_erase(&ext->rb_start, &grp->free_by_start);
+	rb_erase(&ext->rb_len, &grp->free_by_len);
+	kfree(ext);
+}
+
+/* Find the free extent containing @clus */
+static struct fat_free_extent *fat_ext_lookup(struct fat_alloc_group *grp,
+					      unsigned int clus)
+{
+	struct rb_node *n = grp->free_by_start.rb_node;
+	struct fat_free_extent *e;
+
+	while (n) {
+		e = rb_entry(n, struct fat_free_extent, rb_start);
+		if (clus < e->start)
+			n = n->rb_left;
+		else if (clus >= e->start + e->len)
+			n = n->rb_right;
+		else
+			return e;
+	}
+	return NULL;
+}
+
+/* Smallest free extent of at least @len clusters, lowest first */
+static struct fat_free_extent *fat_ext_best_fit(struct fat_alloc_group *grp,
+						unsigned int len)
+{
+	struct rb_node *n = grp->free_by_len.rb_node;
+	struct fat_free_extent *e, *best = NULL;
+
+	while (n) {
+		e = rb_entry(n, struct fat_free_extent, rb_len);
+		if (e->len >= len) {
+			best = e;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+	return best;
+}
+
+/* [start, start + len) is now in use: split its free extent. */
+static void fat_ext_take(struct fat_alloc_group *grp, unsigned int start,
+			 unsigned int len)
+{
+	struct fat_free_extent *ext;
+	unsigned int ext_start, ext_end;
+
+	if (!grp->ext_valid)
+		return;
+	ext = fat_ext_lookup(grp, start);
+	if (!ext)
+		return;
+	ext_start = ext->start;
+	ext_end = ext->start + ext->len;
+	fat_ext_remove(grp, ext);
+	fat_ext_insert(grp, ext_start, start - ext_start);
+	if (start + len < ext_end)
+		fat_ext_insert(grp, start + len, ext_end - (start + len));
+}
+
+/*
+ * [start, start + len) was freed (and cleared in the bitmap): merge it
+ * with the free clusters on either side, within its group.
+ */
+static void fat_ext_give(struct msdos_sb_info *sbi,
+			 struct fat_alloc_group *grp, unsigned int start,
+			 unsigned int len)
+{
+	unsigned int first = fat_group_start(sbi, grp);
+	unsigned int last = fat_group_end(sbi, grp);
+	struct fat_free_extent *ext;
+	unsigned int end = start + len;
+
+	if (!grp->ext_valid)
+		return;
+
+	ext = start > first ? fat_ext_lookup(grp, start - 1) : NULL;
+	if (ext) {
+		start = ext->start;
+		fat_ext_remove(grp, ext);
+	} else {
+		/* A free run not in the tree is shorter than FAT_EXTENT_MIN */
+		while (start > first && !test_bit(start - 1, sbi->clus_bitmap))
+			start--;
+	}
+	ext = end < last ? fat_ext_lookup(grp, end) : NULL;
+	if (ext) {
+		end = ext->start + ext->len;
+		fat_ext_remove(grp, ext);
+	} else
+		end = find_next_bit(sbi->clus_bitmap, last, end);
+
+	fat_ext_insert(grp, start, end - start);
+}
+
+static void fat_ext_build(struct msdos_sb_info *sbi,
+			  struct fat_alloc_group *grp)
+{
+	unsigned long start, end, last = fat_group_end(sbi, grp);
+
+	grp->ext_valid = true;
+	start = find_next_zero_bit(sbi->clus_bitmap, last,
+				   fat_group_start(sbi, grp));
+	while (start < last && grp->ext_valid) {
+		end = find_next_bit(sbi->clus_bitmap, last, start);
+		fat_ext_insert(grp, start, end - start);
+		start = find_next_zero_bit(sbi->clus_bitmap, last, end);
+	}
+}
+
+/*
+ * The free cluster bitmap has one bit per FAT entry, set while the
+ * cluster is in use, plus a free count per allocation group so that the
+ * full parts of a nearly full volume are skipped without touching the
+ * bitmap. It is filled by the background count started at mount, or
+ * else on the first allocation, one group at a time under fat_lock and
+ * the lock of the group, and then kept in sync with the FAT under the
+ * group locks. While it is being filled, only the entries below
+ * ->bitmap_scan are tracked and ->scan_free counts the free ones among
+ * them.
+ */
+static int fat_bitmap_alloc(struct super_block *sb)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	unsigned int nr_groups = DIV_ROUND_UP(sbi->max_cluster, FAT_GROUP_SIZE);
+	struct fat_alloc_group *groups;
+	unsigned long *bitmap;
+	unsigned int i;
+
+	bitmap = kvcalloc(BITS_TO_LONGS(sbi->max_cluster), sizeof(long),
+			  GFP_NOFS);
+	groups = kvcalloc(nr_groups, sizeof(*groups), GFP_NOFS);
+	if (!bitmap || !groups) {
+		kvfree(groups);
+		kvfree(bitmap);
+		return -ENOMEM;
+	}
+	/* The two reserved entries are never free */
+	__set_bit(0, bitmap);
+	__set_bit(1, bitmap);
+
+	sbi->clus_bitmap = bitmap;
+	sbi->groups = groups;
+	sbi->nr_groups = nr_groups;
+	for (i = 0; i < nr_groups; i++) {
+		mutex_init(&groups[i].lock);
+		groups[i].cursor = fat_group_start(sbi, &groups[i]);
+		groups[i].free_by_start = RB_ROOT;
+		groups[i].free_by_len = RB_ROOT;
+	}
+	sbi->bitmap_scan = FAT_START_ENT;
+	sbi->scan_free = 0;
+	return 0;
+}
+
+static void fat_bitmap_free(struct msdos_sb_info *sbi)
+{
+	unsigned int i;
+
+	for (i = 0; sbi->groups && i < sbi->nr_groups; i++)
+		fat_ext_destroy(&sbi->groups[i]);
+	kvfree(sbi->clus_bitmap);
+	kvfree(sbi->groups);
+	sbi->clus_bitmap = NULL;
+	sbi->groups = NULL;
+	sbi->nr_groups = 0;
+	sbi->bitmap_scan = 0;
+}
+
+/*
+ * Add the FAT entries from ->bitmap_scan to the end of its group to the
+ * bitmap. Caller holds fat_lock; the group is locked here, so that no
+ * allocation or free in it runs while it is scanned.
+ */
+static int fat_bitmap_scan(struct super_block *sb, struct fatent_ra *ra)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	const struct fatent_operations *ops = sbi->fatent_ops;
+	struct fat_alloc_group *grp = fat_group(sbi, sbi->bitmap_scan);
+	unsigned int end = fat_group_end(sbi, grp), scanned = 0;
+	struct fat_entry fatent;
+	struct fat_wordscan ws;
+	unsigned long free, mask, *word;
+	unsigned int base, nr;
+	int err = 0;
+
+	mutex_lock(&grp->lock);
+	fatent_init(&fatent);
+	fatent_set_entry(&fatent, sbi->bitmap_scan);
+	while (fatent.entry < end) {
+		/* readahead of fat blocks */
+		fat_ent_reada(sb, ra, &fatent);
+
+		err = fat_ent_read_block(sb, &fatent);
+		if (err)
+			break;
+
+		if (fat_wordscan_ok(sbi)) {
+			fat_wordscan_init(sbi, &ws, &fatent, sbi->max_cluster);
+			while (fat_wordscan_next(sbi, &ws, &base, &free, &mask)) {
+				word = &sbi->clus_bitmap[BIT_WORD(base)];
+				*word = (*word & ~mask) | (~free & mask);
+				nr = hweight_long(free);
+				grp->free += nr;
+				scanned += nr;
+			}
+			fatent.entry = ws.end;
+			WRITE_ONCE(sbi->bitmap_scan, fatent.entry);
+			continue;
+		}
+
+		do {
+			if (ops->ent_get(&fatent) == FAT_ENT_FREE) {
+				grp->free++;
+				scanned++;
+			} else
+				__set_bit(fatent.entry, sbi->clus_bitmap);
+		} while (fat_ent_next(sbi, &fatent));
+		/* whole blocks are scanned, this is the next block's first */
+		WRITE_ONCE(sbi->bitmap_scan, fatent.entry);
+	}
+	fatent_brelse(&fatent);
+	spin_lock(&sbi->free_lock);
+	sbi->scan_free += scanned;
+	spin_unlock(&sbi->free_lock);
+	mutex_unlock(&grp->lock);
+	return err;
+}
+
+/* The scan is complete: the exact free count is known. */
+static void fat_bitmap_done(struct msdos_sb_info *sbi)
+{
+	struct fat_alloc_group *grp;
+
+	spin_lock(&sbi->free_lock);
+	sbi->free_clusters = sbi->scan_free;
+	sbi->free_clus_valid = 1;
+	spin_unlock(&sbi->free_lock);
+
+	for (grp = sbi->groups; grp < sbi->groups + sbi->nr_groups; grp++) {
+		mutex_lock(&grp->lock);
+		fat_ext_build(sbi, grp);
+		mutex_unlock(&grp->lock);
+	}
+}
+
+/* Once true, allocation and free only need the group locks */
+static inline bool fat_bitmap_ready(struct msdos_sb_info *sbi)
+{
+	return sbi->clus_bitmap &&
+	       READ_ONCE(sbi->bitmap_scan) >= sbi->max_cluster;
+}
+
+/* Build the whole bitmap now. Caller holds fat_lock. */
+static int fat_bitmap_build(struct super_block *sb)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fat_entry fatent;
+	struct fatent_ra fatent_ra;
+	int err;
+
+	err = fat_bitmap_alloc(sb);
+	if (err)
+		return err;
+
+	fatent_set_entry(&fatent, FAT_START_ENT);
+	fat_ra_init(sb, &fatent_ra, &fatent, sbi->max_cluster);
+	while (sbi->bitmap_scan < sbi->max_cluster) {
+		err = fat_bitmap_scan(sb, &fatent_ra);
+		if (err) {
+			fat_bitmap_free(sbi);
+			return err;
+		}
+		cond_resched();
+	}
+	fat_bitmap_done(sbi);
+	return 0;
+}
+
+/*
+ * Track @entry as used (or free) in the bitmap. The caller holds the lock
+ * of its group, or fat_lock before the bitmap is complete. Returns true if
+ * the entry was counted in ->scan_free, which the caller then updates.
+ */
+static inline bool fat_bitmap_set(struct msdos_sb_info *sbi, int entry)
+{
+	if (sbi->clus_bitmap && entry < READ_ONCE(sbi->bitmap_scan) &&
+	    !__test_and_set_bit(entry, sbi->clus_bitmap)) {
+		fat_group(sbi, entry)->free--;
+		return true;
+	}
+	return false;
+}
+
+static inline bool fat_bitmap_clear(struct msdos_sb_info *sbi, int entry)
+{
+	if (sbi->clus_bitmap && entry < READ_ONCE(sbi->bitmap_scan) &&
+	    __test_and_clear_bit(entry, sbi->clus_bitmap)) {
+		fat_group(sbi, entry)->free++;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Count the free clusters (and fill the bitmap) in the background after
+ * mount, one group per fat_lock hold. Until it is done, allocations scan
+ * the FAT for free entries and statfs() reports the FSINFO value or the
+ * free clusters seen so far.
+ */
+static int fat_count_thread(void *data)
+{
+	struct super_block *sb = data;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fat_entry fatent;
+	struct fatent_ra fatent_ra;
+	int err = 0;
+
+	fatent_set_entry(&fatent, FAT_START_ENT);
+	fat_ra_init(sb, &fatent_ra, &fatent, sbi->max_cluster);
+	while (!err && !kthread_should_stop()) {
+		lock_fat(sbi);
+		err = fat_bitmap_scan(sb, &fatent_ra);
+		if (!err && sbi->bitmap_scan >= sbi->max_cluster) {
+			fat_bitmap_done(sbi);
+			unlock_fat(sbi);
+			if (!sb_rdonly(sb))
+				mark_fsinfo_dirty(sb);
+			break;
+		}
+		if (err || kthread_should_stop())
+			fat_bitmap_free(sbi);
+		unlock_fat(sbi);
+		cond_resched();
+	}
+	complete_all(&sbi->count_done);
+	return 0;
+}
+
+/* Start the background count, unless there is no memory for the bitmap. */
+void fat_count_start(struct super_block *sb)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct task_struct *task;
+
+	init_completion(&sbi->count_done);
+	if (fat_bitmap_alloc(sb))
+		return;
+	task = kthread_create(fat_count_thread, sb, "fat_count/%s", sb->s_id);
+	if (IS_ERR(task)) {
+		fat_bitmap_free(sbi);
+		return;
+	}
+	/* kept until fat_ent_access_exit(), even if it is done before */
+	get_task_struct(task);
+	sbi->count_thread = task;
+	wake_up_process(task);
+}
+
+/* Find a free cluster in @grp from @start on, wrapping around. -1 if none. */
+static int fat_group_find_free(struct msdos_sb_info *sbi,
+			       struct fat_alloc_group *grp, unsigned int start)
+{
+	unsigned int first = fat_group_start(sbi, grp);
+	unsigned int last = fat_group_end(sbi, grp);
+	unsigned long found;
+
+	if (!grp->free)
+		return -1;
+	if (start < first || start >= last)
+		start = first;
+	found = find_next_zero_bit(sbi->clus_bitmap, last, start);
+	if (found < last)
+		return found;
+	found = find_next_zero_bit(sbi->clus_bitmap, start, first);
+	if (found < start)
+		return found;
+	return -1;
+}
+
+void fat_ent_access_exit(struct super_block *sb)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+
+	/* Send what is still queued */
+	flush_delayed_work(&sbi->discard_work);
+
+	if (sbi->count_thread) {
+		kthread_stop(sbi->count_thread);
+		put_task_struct(sbi->count_thread);
+		sbi->count_thread = NULL;
+	}
+	fat_bitmap_free(sbi);
+	kvfree(sbi->fat_dirty);
+	sbi->fat_dirty = NULL;
+}
+
+static void fat_collect_bhs(struct inode *inode, struct buffer_head **bhs,
+			    int *nr_bhs, struct fat_entry *fatent)
+{
+	int n, i;
+
+	for (n = 0; n < fatent->nr_bhs; n++) {
+		for (i = 0; i < *nr_bhs; i++) {
+			if (fatent->bhs[n] == bhs[i])
+				break;
+		}
+		if (i == *nr_bhs) {
+			fat_fsync_track(inode, fatent->bhs[n]);
+			get_bh(fatent->bhs[n]);
+			bhs[i] = fatent->bhs[n];
+			(*nr_bhs)++;
+		}
+	}
+}
+
+/* Find a free entry by reading the FAT from @start on. */
+static int fat_scan_free(struct super_block *sb, int start)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	const struct fatent_operations *ops = sbi->fatent_ops;
+	struct fat_entry fatent;
+	struct fat_wordscan ws;
+	unsigned long free, mask;
+	unsigned int base;
+	int err, count = FAT_START_ENT;
+
+	fatent_init(&fatent);
+	fatent_set_entry(&fatent, start);
+	while (count < sbi->max_cluster) {
+		if (fatent.entry >= sbi->max_cluster)
+			fatent.entry = FAT_START_ENT;
+		fatent_set_entry(&fatent, fatent.entry);
+		err = fat_ent_read_block(sb, &fatent);
+		if (err)
+			goto out;
+
+		if (fat_wordscan_ok(sbi)) {
+			fat_wordscan_init(sbi, &ws, &fatent, sbi->max_cluster);
+			while (fat_wordscan_next(sbi, &ws, &base, &free, &mask)) {
+				if (free) {
+					err = base + __ffs(free);
+					goto out;
+				}
+			}
+			count += ws.end - fatent.entry;
+			fatent.entry = ws.end;
+			continue;
+		}
+
+		/* Find the free entries in a block */
+		do {
+			if (ops->ent_get(&fatent) == FAT_ENT_FREE) {
+				err = fatent.entry;
+				goto out;
+			}
+			count++;
+			if (count == sbi->max_cluster)
+				break;
+		} while (fat_ent_next(sbi, &fatent));
+	}
+	err = -ENOSPC;
+out:
+	fatent_brelse(&fatent);
+	return err;
+}
+
+/*
+ * Pick a free cluster of @grp for the next @want clusters: @goal if it
+ * is free, else the best fitting free extent, or on the second pass the
+ * largest one if none is big enough. Small requests fill holes first-fit
+ * from the cursor of the group. -1 if there is nothing to take here.
+ */
+static int fat_group_pick(struct msdos_sb_info *sbi,
+			  struct fat_alloc_group *grp, int goal, int want,
+			  int pass)
+{
+	struct fat_free_extent *ext;
+
+	if (goal >= fat_group_start(sbi, grp) &&
+	    goal < fat_group_end(sbi, grp) &&
+	    !test_bit(goal, sbi->clus_bitmap))
+		return goal;
+
+	if (grp->ext_valid && want >= FAT_EXTENT_MIN) {
+		ext = fat_ext_best_fit(grp, want);
+		if (!ext && pass && !RB_EMPTY_ROOT(&grp->free_by_len))
+			ext = rb_entry(rb_last(&grp->free_by_len),
+				       struct fat_free_extent, rb_len);
+		if (ext)
+			return ext->start;
+		if (!pass)
+			return -1;
+	}
+	return fat_group_find_free(sbi, grp, grp->cursor);
+}
+
+/*
+ * Pick the free run for the next @want clusters. Writers start in the
+ * group of @goal, or else in a home group of their inode so that they
+ * don't contend for the same group, and only go to the other groups
+ * when it has no room. Returns the first cluster with its group locked
+ * in *grpp and sets *len (<= @want). Until the bitmap is complete, the
+ * FAT is scanned from prev_free one cluster at a time, under fat_lock.
+ */
+static int fat_find_run(struct inode *inode, int goal, int want, int *len,
+			struct fat_alloc_group **grpp)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fat_alloc_group *grp;
+	unsigned int i, first, nr = sbi->nr_groups;
+	unsigned long end;
+	int pass, start;
+
+	*grpp = NULL;
+	if (!fat_bitmap_ready(sbi)) {
+		*len = 1;
+		return fat_scan_free(sb, sbi->prev_free + 1);
+	}
+
+	if (goal >= FAT_START_ENT && goal < sbi->max_cluster)
+		first = goal >> FAT_GROUP_BITS;
+	else
+		first = inode->i_ino % nr;
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < nr; i++) {
+			grp = &sbi->groups[(first + i) % nr];
+			if (!READ_ONCE(grp->free))
+				continue;
+			mutex_lock(&grp->lock);
+			start = fat_group_pick(sbi, grp, goal, want, pass);
+			if (start >= 0) {
+				end = min_t(unsigned long, fat_group_end(sbi, grp),
+					    (unsigned long)start + want);
+				*len = find_next_bit(sbi->clus_bitmap, end,
+						     start) - start;
+				*grpp = grp;
+				return start;
+			}
+			mutex_unlock(&grp->lock);
+		}
+	}
+	return -ENOSPC;
+}
+
+/* @nr clusters were taken, @tracked of them counted in ->scan_free */
+static void fat_free_sub(struct msdos_sb_info *sbi, unsigned int nr,
+			 unsigned int tracked)
+{
+	spin_lock(&sbi->free_lock);
+	if (sbi->free_clusters != -1)
+		sbi->free_clusters -= nr;
+	sbi->scan_free -= tracked;
+	spin_unlock(&sbi->free_lock);
+}
+
+/* @nr clusters were freed, @tracked of them counted in ->scan_free */
+static void fat_free_add(struct msdos_sb_info *sbi, unsigned int nr,
+			 unsigned int tracked)
+{
+	spin_lock(&sbi->free_lock);
+	if (sbi->free_clusters != -1)
+		sbi->free_clusters += nr;
+	sbi->scan_free += tracked;
+	spin_unlock(&sbi->free_lock);
+}
+
+/*
+ * Allocation and free take fat_lock only until the bitmap is complete.
+ * Returns whether the bitmap is (now) complete, with fat_lock held if
+ * not. An allocation builds the bitmap here if there is none yet.
+ */
+static bool fat_alloc_lock(struct super_block *sb, bool build)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+
+	if (fat_bitmap_ready(sbi))
+		return true;
+	lock_fat(sbi);
+	/* Without the bitmap (no memory), fall back to scanning the FAT. */
+	if (build && !sbi->clus_bitmap)
+		fat_bitmap_build(sb);
+	if (!fat_bitmap_ready(sbi))
+		return false;
+	unlock_fat(sbi);
+	return true;
+}
+
+/*
+ * With "discard", freed runs of clusters are queued in ->discard_tree,
+ * merged with the adjacent ones, and discarded in batches by
+ * fat_discard_work() rather than by the task freeing them. A run the
+ * allocator takes again is dropped from the queue first; if it is being
+ * discarded, the allocator waits for that batch.
+ */
+struct fat_discard {
+	struct rb_node node;	/* in ->discard_tree, by start */
+	struct list_head batch;	/* in the batch being discarded */
+	int start;
+	int len;
+	bool busy;		/* in the batch being discarded */
+};
+
+/* runs taken per batch, and how long a run waits for neighbours */
+#define FAT_DISCARD_BATCH	64
+#define FAT_DISCARD_DELAY	HZ
+/* queued clusters that start a batch at once */
+#define FAT_DISCARD_KICK	(1U << 16)
+
+/* The last run starting before @end, or NULL. Caller holds discard_lock. */
+static struct fat_discard *fat_discard_before(struct msdos_sb_info *sbi,
+					      int end)
+{
+	struct rb_node *n = sbi->discard_tree.rb_node;
+	struct fat_discard *d, *found = NULL;
+
+	while (n) {
+		d = rb_entry(n, struct fat_discard, node);
+		if (d->start < end) {
+			found = d;
+			n = n->rb_right;
+		} else {
+			n = n->rb_left;
+		}
+	}
+	return found;
+}
+
+static void fat_discard_insert(struct msdos_sb_info *sbi,
+			       struct fat_discard *new)
+{
+	struct rb_node **p = &sbi->discard_tree.rb_node, *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (new->start < rb_entry(parent, struct fat_discard,
+					  node)->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &sbi->discard_tree);
+}
+
+static void fat_discard_erase(struct msdos_sb_info *sbi,
+			      struct fat_discard *d)
+{
+	rb_erase(&d->node, &sbi->discard_tree);
+	kfree(d);
+}
+
+/* Queue the freed run of @len clusters at @start for discard. */
+static void fat_discard_queue(struct super_block *sb, int start, int len)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fat_discard *new, *prev, *next = NULL;
+	struct rb_node *n;
+	unsigned int queued;
+
+	if (!sbi->options.discard || !len ||
+	    !bdev_max_discard_sectors(sb->s_bdev))
+		return;
+	/* Discard is only a hint, without memory the run is not queued */
+	new = kmalloc(sizeof(*new), GFP_NOFS);
+	if (!new)
+		return;
+
+	spin_lock(&sbi->discard_lock);
+	prev = fat_discard_before(sbi, start);
+	n = prev ? rb_next(&prev->node) : rb_first(&sbi->discard_tree);
+	if (n)
+		next = rb_entry(n, struct fat_discard, node);
+
+	if (prev && !prev->busy && prev->start + prev->len == start) {
+		prev->len += len;
+		if (next && !next->busy &&
+		    prev->start + prev->len == next->start) {
+			prev->len += next->len;
+			fat_discard_erase(sbi, next);
+		}
+		kfree(new);
+	} else if (next && !next->busy && start + len == next->start) {
+		/* still between prev and next, the order holds */
+		next->start = start;
+		next->len += len;
+		kfree(new);
+	} else {
+		new->start = start;
+		new->len = len;
+		new->busy = false;
+		fat_discard_insert(sbi, new);
+	}
+	sbi->discard_queued += len;
+	queued = sbi->discard_queued;
+	spin_unlock(&sbi->discard_lock);
+
+	if (queued >= FAT_DISCARD_KICK)
+		mod_delayed_work(system_wq, &sbi->discard_work, 0);
+	else
+		queue_delayed_work(system_wq, &sbi->discard_work,
+				   FAT_DISCARD_DELAY);
+}
+
+/*
+ * The allocator takes the @len clusters at @start: drop them from the
+ * queued runs, waiting for the batch being discarded if it holds any.
+ */
+static void fat_discard_cancel(struct super_block *sb, int start, int len)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fat_discard *d, *tail = NULL;
+	int end = start + len, d_end;
+	unsigned int seq;
+
+	if (!sbi->options.discard)
+		return;
+again:
+	spin_lock(&sbi->discard_lock);
+	while ((d = fat_discard_before(sbi, end)) != NULL &&
+	       d->start + d->len > start) {
+		if (d->busy) {
+			seq = sbi->discard_seq;
+			spin_unlock(&sbi->discard_lock);
+			wait_event(sbi->discard_wait,
+				   READ_ONCE(sbi->discard_seq) != seq);
+			goto again;
+		}
+
+		d_end = d->start + d->len;
+		if (d_end > end) {
+			/* keep the part past the allocation */
+			if (d->start >= start) {
+				sbi->discard_queued -= end - d->start;
+				d->len = d_end - end;
+				d->start = end;
+				continue;
+			}
+			if (!tail) {
+				/* splitting needs a new run */
+				spin_unlock(&sbi->discard_lock);
+				tail = kmalloc(sizeof(*tail), GFP_NOFS);
+				if (!tail) {
+					/* drop the part past it instead */
+					spin_lock(&sbi->discard_lock);
+					d = fat_discard_before(sbi, end);
+					if (d && !d->busy &&
+					    d->start + d->len > end) {
+						sbi->discard_queued -=
+							d->start + d->len - end;
+						d->len = end - d->start;
+					}
+					spin_unlock(&sbi->discard_lock);
+				}
+				goto again;
+			}
+			tail->start = end;
+			tail->len = d_end - end;
+			tail->busy = false;
+			fat_discard_insert(sbi, tail);
+			tail = NULL;
+			d_end = end;
+		}
+
+		if (d->start >= start) {
+			sbi->discard_queued -= d_end - d->start;
+			fat_discard_erase(sbi, d);
+		} else {
+			sbi->discard_queued -= d_end - start;
+			d->len = start - d->start;
+			break;
+		}
+	}
+	spin_unlock(&sbi->discard_lock);
+	kfree(tail);
+}
+
+/* Round @sect to the discard granularity of the device */
+static sector_t fat_discard_round(sector_t sect, unsigned int gran,
+				  unsigned int align, bool up)
+{
+	sector_t tmp = sect + gran - align;
+	unsigned int rem = sector_div(tmp, gran);
+
+	if (!rem)
+		return sect;
+	return up ? sect + gran - rem : sect - rem;
+}
+
+void fat_discard_work(struct work_struct *work)
+{
+	struct msdos_sb_info *sbi = container_of(to_delayed_work(work),
+						 struct msdos_sb_info,
+						 discard_work);
+	struct super_block *sb = sbi->sb;
+	struct block_device *bdev = sb->s_bdev;
+	const unsigned int shift = sb->s_blocksize_bits - 9;
+	unsigned int gran, align;
+	struct fat_discard *d, *tmp;
+	struct blk_plug plug;
+	struct rb_node *n;
+	sector_t start, end;
+	struct bio *bio;
+	LIST_HEAD(batch);
+	int nr;
+
+	gran = max(bdev_discard_granularity(bdev) >> 9, 1U);
+	align = (bdev_discard_alignment(bdev) >> 9) % gran;
+	for (;;) {
+		spin_lock(&sbi->discard_lock);
+		for (n = rb_first(&sbi->discard_tree), nr = 0;
+		     n && nr < FAT_DISCARD_BATCH; n = rb_next(n), nr++) {
+			d = rb_entry(n, struct fat_discard, node);
+			d->busy = true;
+			list_add_tail(&d->batch, &batch);
+		}
+		spin_unlock(&sbi->discard_lock);
+		if (list_empty(&batch))
+			break;
+
+		/* Only whole granules are sent, the device drops the rest */
+		bio = NULL;
+		blk_start_plug(&plug);
+		list_for_each_entry(d, &batch, batch) {
+			start = (sector_t)fat_clus_to_blknr(sbi, d->start) << shift;
+			end = start + ((sector_t)d->len * sbi->sec_per_clus << shift);
+			start = fat_discard_round(start, gran, align, true);
+			end = fat_discard_round(end, gran, align, false);
+			if (start < end)
+				__blkdev_issue_discard(bdev, start, end - start,
+						       GFP_NOFS, &bio);
+		}
+		if (bio) {
+			submit_bio_wait(bio);
+			bio_put(bio);
+		}
+		blk_finish_plug(&plug);
+
+		spin_lock(&sbi->discard_lock);
+		list_for_each_entry_safe(d, tmp, &batch, batch) {
+			list_del(&d->batch);
+			sbi->discard_queued -= d->len;
+			fat_discard_erase(sbi, d);
+		}
+		sbi->discard_seq++;
+		spin_unlock(&sbi->discard_lock);
+		wake_up_all(&sbi->discard_wait);
+		cond_resched();
+	}
+}
+
+/* Write out (if @sync) and mirror the collected bhs, then drop them. */
+static int fat_release_bhs(struct super_block *sb, struct buffer_head **bhs,
+			   int *nr_bhs, int sync)
+{
+	int i, err = 0;
+
+	if (sync)
+		err = fat_sync_bhs(bhs, *nr_bhs);
+	if (!err)
+		err = fat_mirror_bhs(sb, bhs, *nr_bhs);
+	for (i = 0; i < *nr_bhs; i++)
+		brelse(bhs[i]);
+	*nr_bhs = 0;
+	return err;
+}
+
+/*
+ * Chain the run of @len clusters at @start and link it after @last, if
+ * not 0. The run is written from its end, so that whatever was written
+ * when an error stops it is a chain: *chained tells how many clusters at
+ * the end of the run are in it.
+ */
+static int fat_chain_run(struct inode *inode, struct fat_entry *fatent,
+			 struct buffer_head **bhs, int *nr_bhs, int sync,
+			 int start, int len, int last, int *chained)
+{
+	struct super_block *sb = inode->i_sb;
+	const struct fatent_operations *ops = MSDOS_SB(sb)->fatent_ops;
+	int i, err;
+
+	*chained = 0;
+	for (i = len - 1; i >= 0; i--) {
+		if (*nr_bhs + 2 > MAX_BUF_PER_PAGE) {
+			err = fat_release_bhs(sb, bhs, nr_bhs, sync);
+			if (err)
+				return err;
+		}
+		err = fat_ent_read(inode, fatent, start + i);
+		if (err < 0)
+			return err;
+		ops->ent_put(fatent, i + 1 < len ? start + i + 1 : FAT_ENT_EOF);
+		fat_collect_bhs(inode, bhs, nr_bhs, fatent);
+		(*chained)++;
+	}
+	if (!last)
+		return 0;
+
+	/* the previous run is ours, its group needs no lock */
+	if (*nr_bhs + 2 > MAX_BUF_PER_PAGE) {
+		err = fat_release_bhs(sb, bhs, nr_bhs, sync);
+		if (err)
+			return err;
+	}
+	err = fat_ent_read(inode, fatent, last);
+	if (err < 0)
+		return err;
+	ops->ent_put(fatent, start);
+	fat_collect_bhs(inode, bhs, nr_bhs, fatent);
+	return 0;
+}
+
+/* Where the next cluster of @inode would best go */
+static int fat_alloc_goal(struct inode *inode)
+{
+	int fclus, dclus;
+
+	if (!MSDOS_I(inode)->i_start)
+		return 0;
+	if (fat_get_cluster(inode, FAT_ENT_EOF, &fclus, &dclus) < 0)
+		return 0;
+	return dclus + 1;
+}
+
+/*
+ * Is there room for @need clusters besides the reserved ones? While the
+ * free clusters are counted, reservations are granted against those seen
+ * so far, so other allocations must leave them those. Caller holds
+ * free_lock.
+ */
+static bool fat_alloc_room(struct msdos_sb_info *sbi, unsigned int need)
+{
+	if (fat_free_valid(sbi))
+		return sbi->free_clusters >= need + sbi->reserved_clusters;
+	if (fat_counting(sbi) && sbi->reserved_clusters)
+		return sbi->scan_free >= need + sbi->reserved_clusters;
+	return true;
+}
+
+/*
+ * Allocate a chain of @nr_cluster clusters, made of as few contiguous
+ * runs as the free space allows, and return its head in *first. The
+ * clusters are also stored to @cluster unless it is NULL.
+ */
+static int __fat_alloc_chain(struct inode *inode, int nr_cluster,
+			     int *cluster, int *first, bool reserved)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct fat_alloc_group *grp = NULL;
+	struct fat_entry fatent;
+	struct buffer_head *bhs[MAX_BUF_PER_PAGE];
+	int sync = inode_needs_sync(inode);
+	int i, err, nr_bhs, done, start, len, last, goal, chained;
+	int orphan = 0;
+	unsigned int tracked, need;
+	bool ready;
+
+	goal = fat_alloc_goal(inode);
+
+	/*
+	 * Claim the clusters as a reservation along with the check, so that
+	 * concurrent allocations and fat_reserve_clusters() can't be granted
+	 * them too. The claim shrinks as runs are taken and what is left of
+	 * it is dropped on exit.
+	 *
+	 * Reserved clusters are counted in ->reserved_clusters already. The
+	 * caller drops the reservation once the chain is added, and keeps
+	 * it if anything fails, for the retry.
+	 */
+	need = reserved ? 0 : nr_cluster;
+	spin_lock(&sbi->free_lock);
+	if (!fat_alloc_room(sbi, need) && !fat_free_valid(sbi)) {
+		/* Not enough free clusters seen yet: wait for the count */
+		spin_unlock(&sbi->free_lock);
+		err = fat_count_free_clusters(sb);
+		if (err)
+			return err;
+		spin_lock(&sbi->free_lock);
+	}
+	if (!fat_alloc_room(sbi, need)) {
+		spin_unlock(&sbi->free_lock);
+		return -ENOSPC;
+	}
+	sbi->reserved_clusters += need;
+	spin_unlock(&sbi->free_lock);
+
+	ready = fat_alloc_lock(sb, true);
+
+	err = nr_bhs = done = last = 0;
+	fatent_init(&fatent);
+	while (done < nr_cluster) {
+		start = fat_find_run(inode, goal, nr_cluster - done, &len, &grp);
+		if (start < 0) {
+			err = start;
+			goto out;
+		}
+
+		/* Trust the FAT over the bitmap: stop at a used entry */
+		for (i = 0; i < len; i++) {
+			err = fat_ent_read(inode, &fatent, start + i);
+			if (err < 0)
+				goto out;
+			if (err != FAT_ENT_FREE) {
+				tracked = fat_bitmap_set(sbi, start + i);
+				if (grp)
+					fat_ext_take(grp, start + i, 1);
+				fat_free_sub(sbi, 1, tracked);
+				break;
+			}
+		}
+		err = 0;
+		len = i;
+		if (!len) {
+			if (grp)
+				mutex_unlock(&grp->lock);
+			grp = NULL;
+			goal = 0;
+			continue;
+		}
+
+		fat_discard_cancel(sb, start, len);
+
+		err = fat_chain_run(inode, &fatent, bhs, &nr_bhs, sync,
+				    start, len, last, &chained);
+
+		/* What was chained is in use, even if it isn't linked */
+		tracked = 0;
+		for (i = len - chained; i < len; i++)
+			tracked += fat_bitmap_set(sbi, start + i);
+		if (grp) {
+			if (chained)
+				fat_ext_take(grp, start + len - chained, chained);
+			grp->cursor = start + len;
+		}
+		spin_lock(&sbi->free_lock);
+		if (sbi->free_clusters != -1)
+			sbi->free_clusters -= chained;
+		sbi->scan_free -= tracked;
+		if (need) {
+			sbi->reserved_clusters -= chained;
+			need -= chained;
+		}
+		sbi->prev_free = start + len - 1;
+		spin_unlock(&sbi->free_lock);
+		if (grp)
+			mutex_unlock(&grp->lock);
+		grp = NULL;
+
+		if (err) {
+			/* freed below, apart from the chain linked so far */
+			if (chained)
+				orphan = start + len - chained;
+			goto out;
+		}
+		if (!last)
+			*first = start;
+		if (cluster) {
+			for (i = 0; i < len; i++)
+				cluster[done + i] = start + i;
+		}
+
+		last = start + len - 1;
+		goal = last + 1;
+		done += len;
+	}
+
+out:
+	if (grp)
+		mutex_unlock(&grp->lock);
+	if (need)
+		fat_release_clusters(sb, need);
+	if (!ready) {
+		if (err == -ENOSPC) {
+			/* Couldn't allocate the free entries */
+			spin_lock(&sbi->free_lock);
+			sbi->free_clusters = 0;
+			sbi->free_clus_valid = 1;
+			spin_unlock(&sbi->free_lock);
+		}
+		unlock_fat(sbi);
+	}
+	mark_fsinfo_dirty(sb);
+	fatent_brelse(&fatent);
+	if (!err)
+		err = fat_release_bhs(sb, bhs, &nr_bhs, sync);
+	for (i = 0; i < nr_bhs; i++)
+		brelse(bhs[i]);
+
+	if (err && done)
+		fat_free_clusters_prfs(inode, *first);
+	if (orphan)
+		fat_free_clusters_prfs(inode, orphan);
+
+	return err;
+}
+
+int fat_alloc_clusters(struct inode *inode, int *cluster, int nr_cluster)
+{
+	int first;
+
+	return __fat_alloc_chain(inode, nr_cluster, cluster, &first, false);
+}
+
+/*
+ * Allocate a chain of @nr_cluster clusters. If @reserved, they were
+ * reserved by fat_reserve_clusters() before, and the caller releases
+ * the reservation when done with the chain.
+ */
+int fat_alloc_chain(struct inode *inode, int nr_cluster, int *first,
+		    bool reserved)
+{
+	return __fat_alloc_chain(inode, nr_cluster, NULL, first, reserved);
+}
+
+/*
+ * Delayed allocation: set aside @nr_cluster free clusters without picking
+ * them, so that running out of space is reported by write() and not when
+ * the pages are written back.
+ */
+int fat_reserve_clusters(struct super_block *sb, int nr_cluster)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	int err;
+
+	/* While counting, the free clusters seen so far are surely free */
+	spin_lock(&sbi->free_lock);
+	if (!fat_free_valid(sbi) && fat_counting(sbi) &&
+	    sbi->scan_free >= sbi->reserved_clusters + nr_cluster) {
+		sbi->reserved_clusters += nr_cluster;
+		spin_unlock(&sbi->free_lock);
+		return 0;
+	}
+	spin_unlock(&sbi->free_lock);
+
+	/* If the count of free cluster is still unknown, counts it here. */
+	err = fat_count_free_clusters(sb);
+	if (err)
+		return err;
+
+	spin_lock(&sbi->free_lock);
+	if (sbi->free_clusters < sbi->reserved_clusters + nr_cluster)
+		err = -ENOSPC;
+	else
+		sbi->reserved_clusters += nr_cluster;
+	spin_unlock(&sbi->free_lock);
+	return err;
+}
+
+void fat_release_clusters(struct super_block *sb, int nr_cluster)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+
+	spin_lock(&sbi->free_lock);
+	sbi->reserved_clusters -= nr_cluster;
+	spin_unlock(&sbi->free_lock);
+}
+
+/*
+ * A run of freed clusters is complete: hand it to its group and queue
+ * its discard, both before the group lock is dropped.
+ */
+static void fat_free_run(struct super_block *sb, struct fat_alloc_group *grp,
+			 int start, int len)
+{
+	if (!len)
+		return;
+	if (grp)
+		fat_ext_give(MSDOS_SB(sb), grp, start, len);
+	fat_discard_queue(sb, start, len);
+}
+
+int fat_free_clusters_prfs(struct inode *inode, int cluster)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	const struct fatent_operations *ops = sbi->fatent_ops;
+	struct fat_alloc_group *grp = NULL;
+	struct fat_entry fatent;
+	struct buffer_head *bhs[MAX_BUF_PER_PAGE];
+	int i, err, nr_bhs;
+	int dirty_fsinfo = 0;
+	int run_start = 0, run_len = 0;
+	unsigned int nr_freed = 0, tracked = 0;
+	bool ready;
+
+	//dbg printk(KERN_INFO "fat_free_clusters_prfs function...\n");
+
+	nr_bhs = 0;
+	fatent_init(&fatent);
+	ready = fat_alloc_lock(sb, false);
+	do {
+		/* Free the chain one group at a time, under its lock */
+		if (ready && fat_valid_entry(sbi, cluster) &&
+		    grp != fat_group(sbi, cluster)) {
+			if (grp) {
+				fat_free_run(sb, grp, run_start, run_len);
+				run_len = 0;
+				fat_free_add(sbi, nr_freed, tracked);
+				nr_freed = tracked = 0;
+				mutex_unlock(&grp->lock);
+			}
+			grp = fat_group(sbi, cluster);
+			mutex_lock(&grp->lock);
+		}
+
+		cluster = fat_ent_read(inode, &fatent, cluster);
+		if (cluster < 0) {
+			err = cluster;
+			goto error;
+		} else if (cluster == FAT_ENT_FREE) {
+			fat_fs_error(sb, "%s: deleting FAT entry beyond EOF",
+				     __func__);
+			err = -EIO;
+			goto error;
+		}
+
+		ops->ent_put(&fatent, FAT_ENT_FREE);
+		if (run_len && fatent.entry == run_start + run_len) {
+			run_len++;
+		} else {
+			/* before the bitmap shows the next run as free */
+			fat_free_run(sb, grp, run_start, run_len);
+			run_start = fatent.entry;
+			run_len = 1;
+		}
+		tracked += fat_bitmap_clear(sbi, fatent.entry);
+		nr_freed++;
+		if (sbi->free_clusters != -1)
+			dirty_fsinfo = 1;
+
+		if (nr_bhs + fatent.nr_bhs > MAX_BUF_PER_PAGE) {
+			if (sb->s_flags & SB_SYNCHRONOUS) {
+				err = fat_sync_bhs(bhs, nr_bhs);
+				if (err)
+					goto error;
+			}
+			err = fat_mirror_bhs(sb, bhs, nr_bhs);
+			if (err)
+				goto error;
+			for (i = 0; i < nr_bhs; i++)
+				brelse(bhs[i]);
+			nr_bhs = 0;
+		}
+		fat_collect_bhs(inode, bhs, &nr_bhs, &fatent);
+	} while (cluster != FAT_ENT_EOF);
+
+	if (sb->s_flags & SB_SYNCHRONOUS) {
+		err = fat_sync_bhs(bhs, nr_bhs);
+		if (err)
+			goto error;
+	}
+	err = fat_mirror_bhs(sb, bhs, nr_bhs);
+error:
+	fat_free_run(sb, grp, run_start, run_len);
+	fat_free_add(sbi, nr_freed, tracked);
+	if (grp)
+		mutex_unlock(&grp->lock);
+	fatent_brelse(&fatent);
+	for (i = 0; i < nr_bhs; i++)
+		brelse(bhs[i]);
+	if (!ready)
+		unlock_fat(sbi);
+	if (dirty_fsinfo)
+		mark_fsinfo_dirty(sb);
+
+	return err;
+}
+EXPORT_SYMBOL_GPL(fat_free_clusters_prfs);
+
+int fat_count_free_clusters(struct super_block *sb)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	const struct fatent_operations *ops = sbi->fatent_ops;
+	struct fat_entry fatent;
+	struct fatent_ra fatent_ra;
+	struct fat_wordscan ws;
+	unsigned long bits, mask;
+	unsigned int base;
+	int err = 0, free;
+
+	/* Wait for the background count rather than doing it twice */
+	if (!fat_free_valid(sbi) && fat_counting(sbi))
+		wait_for_completion(&sbi->count_done);
+
+	lock_fat(sbi);
+	if (fat_free_valid(sbi))
+		goto out;
+
+	free = 0;
+	fatent_init(&fatent);
+	fatent_set_entry(&fatent, FAT_START_ENT);
+	fat_ra_init(sb, &fatent_ra, &fatent, sbi->max_cluster);
+	while (fatent.entry < sbi->max_cluster) {
+		/* readahead of fat blocks */
+		fat_ent_reada(sb, &fatent_ra, &fatent);
+
+		err = fat_ent_read_block(sb, &fatent);
+		if (err)
+			goto out;
+
+		if (fat_wordscan_ok(sbi)) {
+			fat_wordscan_init(sbi, &ws, &fatent, sbi->max_cluster);
+			while (fat_wordscan_next(sbi, &ws, &base, &bits, &mask))
+				free += hweight_long(bits);
+			fatent.entry = ws.end;
+		} else {
+			do {
+				if (ops->ent_get(&fatent) == FAT_ENT_FREE)
+					free++;
+			} while (fat_ent_next(sbi, &fatent));
+		}
+		cond_resched();
+	}
+	spin_lock(&sbi->free_lock);
+	sbi->free_clusters = free;
+	sbi->free_clus_valid = 1;
+	spin_unlock(&sbi->free_lock);
+	mark_fsinfo_dirty(sb);
+	fatent_brelse(&fatent);
+out:
+	unlock_fat(sbi);
+	return err;
+}
+
+static int fat_trim_clusters(struct super_block *sb, u32 clus, u32 nr_clus)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	return sb_issue_discard(sb, fat_clus_to_blknr(sbi, clus),
+				nr_clus * sbi->sec_per_clus, GFP_NOFS, 0);
+}
+
+/* Trim the free run of @nr clusters ending before @end, if long enough */
+static int fat_trim_run(struct super_block *sb, u32 end, u32 nr, u64 minlen,
+			u64 *trimmed)
+{
+	int err;
+
+	if (!nr || nr < minlen)
+		return 0;
+	err = fat_trim_clusters(sb, end - nr, nr);
+	if (err && err != -EOPNOTSUPP)
+		return err;
+	if (!err)
+		*trimmed += nr;
+	return 0;
+}
+
+int fat_trim_fs(struct inode *inode, struct fstrim_range *range)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	const struct fatent_operations *ops = sbi->fatent_ops;
+	struct fat_entry fatent;
+	struct fatent_ra fatent_ra;
+	struct fat_wordscan ws;
+	unsigned long bits, mask;
+	unsigned int base, next;
+	u64 ent_start, ent_end, minlen, trimmed = 0;
+	struct fat_alloc_group *grp = NULL;
+	u32 free = 0;
+	int err = 0;
+
+	/*
+	 * FAT data is organized as clusters, trim at the granulary of cluster.
 	 *
 	 * fstrim_range is in byte, convert values to cluster index.
 	 * Treat sectors before data region as all used, not to trim them.
@@ -802,29 +2359,70 @@ int fat_trim_fs(struct inode *inode, struct fstrim_range *range)
 	fatent_set_entry(&fatent, ent_start);
 	fat_ra_init(sb, &fatent_ra, &fatent, ent_end + 1);
 	while (fatent.entry <= ent_end) {
+		/*
+		 * Once allocations go by the bitmap, lock out those of the
+		 * group being read, so a free run is not taken before it
+		 * is trimmed.
+		 */
+		if (fat_bitmap_ready(sbi) &&
+		    (!grp || fatent.entry >= fat_group_end(sbi, grp))) {
+			err = fat_trim_run(sb, fatent.entry, free, minlen,
+					   &trimmed);
+			if (err)
+				goto error;
+			free = 0;
+			if (grp)
+				mutex_unlock(&grp->lock);
+			grp = fat_group(sbi, fatent.entry);
+			mutex_lock(&grp->lock);
+		}
+
 		/* readahead of fat blocks */
 		fat_ent_reada(sb, &fatent_ra, &fatent);
 
 		err = fat_ent_read_block(sb, &fatent);
 		if (err)
 			goto error;
-		do {
-			if (ops->ent_get(&fatent) == FAT_ENT_FREE) {
-				free++;
-			} else if (free) {
-				if (free >= minlen) {
-					u32 clus = fatent.entry - free;
-
-					err = fat_trim_clusters(sb, clus, free);
-					if (err && err != -EOPNOTSUPP)
+		if (fat_wordscan_ok(sbi)) {
+			fat_wordscan_init(sbi, &ws, &fatent, ent_end + 1);
+			while (fat_wordscan_next(sbi, &ws, &base, &bits, &mask)) {
+				unsigned int bit = __ffs(mask), last = fls_long(mask);
+
+				/* an all free word needs no walk over its bits */
+				if (bits == mask) {
+					free += last - bit;
+					continue;
+				}
+				while (bit < last) {
+					if (test_bit(bit, &bits)) {
+						next = find_next_zero_bit(&bits, last, bit);
+						free += next - bit;
+						bit = next;
+						continue;
+					}
+					err = fat_trim_run(sb, base + bit, free,
+							   minlen, &trimmed);
+					if (err)
 						goto error;
-					if (!err)
-						trimmed += free;
-					err = 0;
+					free = 0;
+					bit = find_next_bit(&bits, last, bit);
 				}
-				free = 0;
 			}
-		} while (fat_ent_next(sbi, &fatent) && fatent.entry <= ent_end);
+			fatent.entry = ws.end;
+		} else {
+			do {
+				if (ops->ent_get(&fatent) == FAT_ENT_FREE) {
+					free++;
+					continue;
+				}
+				err = fat_trim_run(sb, fatent.entry, free,
+						   minlen, &trimmed);
+				if (err)
+					goto error;
+				free = 0;
+			} while (fat_ent_next(sbi, &fatent) &&
+				 fatent.entry <= ent_end);
+		}
 
 		if (fatal_signal_pending(current)) {
 			err = -ERESTARTSYS;
@@ -832,26 +2430,28 @@ int fat_trim_fs(struct inode *inode, struct fstrim_range *range)
 		}
 
 		if (need_resched()) {
+			/* the run may be allocated once unlocked */
+			err = fat_trim_run(sb, fatent.entry, free, minlen,
+					   &trimmed);
+			if (err)
+				goto error;
+			free = 0;
 			fatent_brelse(&fatent);
+			if (grp)
+				mutex_unlock(&grp->lock);
+			grp = NULL;
 			unlock_fat(sbi);
 			cond_resched();
 			lock_fat(sbi);
 		}
 	}
 	/* handle scenario when tail entries are all free */
-	if (free && free >= minlen) {
-		u32 clus = fatent.entry - free;
-
-		err = fat_trim_clusters(sb, clus, free);
-		if (err && err != -EOPNOTSUPP)
-			goto error;
-		if (!err)
-			trimmed += free;
-		err = 0;
-	}
+	err = fat_trim_run(sb, fatent.entry, free, minlen, &trimmed);
 
 error:
 	fatent_brelse(&fatent);
+	if (grp)
+		mutex_unlock(&grp->lock);
 	unlock_fat(sbi);
 
 	range->len = trimmed << sbi->cluster_bits;
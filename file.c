@@ -191,11 +191,8 @@ static int fat_file_release(struct inode *inode, struct file *filp)
 {
 	//dbg printk(KERN_INFO "fat_file_release function...\n");
 	if ((filp->f_mode & FMODE_WRITE) &&
-	    MSDOS_SB(inode->i_sb)->options.flush) {
-		fat_flush_inodes_prfs(inode->i_sb, inode, NULL);
-		set_current_state(TASK_UNINTERRUPTIBLE);
-		io_schedule_timeout(HZ/10);
-	}
+	    MSDOS_SB(inode->i_sb)->options.flush)
+		fat_flush_on_close(inode);
 	return 0;
 }
 
@@ -210,11 +207,12 @@ int fat_file_fsync(struct file *filp, loff_t start, loff_t end, int datasync)
 	if (err)
 		return err;
 
-	err = sync_mapping_buffers(MSDOS_SB(inode->i_sb)->fat_inode->i_mapping);
+	/* The mirror FATs follow with the FSINFO writeback */
+	err = fat_sync_inode_fat(inode);
 	if (err)
 		return err;
 
-	return blkdev_issue_flush(inode->i_sb->s_bdev);
+	return fat_flush_device(inode->i_sb);
 }
 
 // How to clone a file: https://stackoverflow.com/questions/60665151/clone-a-file-in-linux-kernel-module
@@ -284,6 +282,7 @@ int file_readwrite(struct file * filp)
 	if (((int)(filp->f_flags) & 3) >0) return 1;
 	return 0;
 }
+EXPORT_SYMBOL_GPL(file_readwrite);
 
 // file_justcreated
 // returns 0 alread exists
@@ -314,14 +313,28 @@ int filename_backup(const char * fname)
 }
 EXPORT_SYMBOL_GPL(filename_backup);
 
+// prfs_backup_prefix
+// create beginning _NNNNNNNNNNNN_ (N=number) of backup filename from ts:
+// the last 10 digits of the seconds followed by the milliseconds
+void prfs_backup_prefix(char * fname, int len, const struct timespec64 *ts)
+{
+	char stmp1[20], stmp2[20];
+
+	if (len <16) 
+		return;
+	snprintf(stmp1, 16, "%015llu", ts->tv_sec);
+	snprintf(stmp2, 10, "%09lu", ts->tv_nsec);
+	snprintf(fname, 16, "_%c%c%c%c%c%c%c%c%c%c%c%c%c_", 
+		stmp1[5], stmp1[6], stmp1[7], stmp1[8], stmp1[9], stmp1[10], stmp1[11], stmp1[12], stmp1[13], stmp1[14],
+		stmp2[0], stmp2[1], stmp2[2] );
+}
+EXPORT_SYMBOL_GPL(prfs_backup_prefix);
+
 // create_backup_filename_trailing
 // create beginning _NNNNNNNNNNNN_ (N=number) of backup filename from present time
 void create_backup_filename_trailing(char * fname, int len)
 {
 	struct timespec64 now;
-	//long long unsigned int sc, ms;
-	//float tsc;
-	char stmp1[20], stmp2[20];
 	
 	if (len <16) 
 	{
@@ -329,16 +342,8 @@ void create_backup_filename_trailing(char * fname, int len)
 		return;
 	}		
 	ktime_get_real_ts64(&now);
-	//tsc = (float)now.tv_sec;
-	//sc = (long long unsigned int)(tsc - 1e10 * (float)((long long unsigned int)(tsc / 1e10)));
-	//ms = (long long unsigned int)((float)now.tv_nsec / 1e6);
-	//snprintf(fname, 15, "_%010llu%03llu_", sc, ms);
-	snprintf(stmp1, 16, "%015llu", now.tv_sec);
-	snprintf(stmp2, 10, "%09lu", now.tv_nsec);
-	snprintf(fname, 16, "_%c%c%c%c%c%c%c%c%c%c%c%c%c_", 
-		stmp1[5], stmp1[6], stmp1[7], stmp1[8], stmp1[9], stmp1[10], stmp1[11], stmp1[12], stmp1[13], stmp1[14],
-		stmp2[0], stmp2[1], stmp2[2] );
-	printk(KERN_INFO "create_backup_filename_trailing: %llu %lu %s %s %s\n", now.tv_sec, now.tv_nsec, stmp1, stmp2, fname);
+	prfs_backup_prefix(fname, len, &now);
+	printk(KERN_INFO "create_backup_filename_trailing: %llu %lu %s\n", now.tv_sec, now.tv_nsec, fname);
 }
 
 // prfs_make_backup
@@ -348,10 +353,12 @@ void create_backup_filename_trailing(char * fname, int len)
 int prfs_make_backup(const char * fname)
 {
 	struct file *original_filp, *copy_filp;
+	struct timespec64 now;
 	char fn2[260], tme[20]; 
 	int snpres;
 
-	create_backup_filename_trailing(tme, sizeof tme);
+	ktime_get_real_ts64(&now);
+	prfs_backup_prefix(tme, sizeof tme, &now);
 	snpres = snprintf(fn2, sizeof fn2, "%s%s", tme, fname);
 	printk(KERN_INFO "prfs_make_backup: %s fn2: %s, res: %i\n", fname, fn2, snpres);
 	// https://stackoverflow.com/questions/60665151/clone-a-file-in-linux-kernel-module
@@ -368,8 +375,21 @@ int prfs_make_backup(const char * fname)
 	if (IS_ERR(copy_filp) || (copy_filp == NULL)) 
 	{
 		printk(KERN_INFO "prfs_make_backup: %s: error opening %s in copy: exiting\n", fname, fn2);
+		filp_close(original_filp, NULL);
+		return -1;
+	}
+	// only a copy made by this open on a PRFS volume becomes a backup
+	if (!(copy_filp->f_mode & FMODE_CREATED) ||
+	    file_inode(copy_filp)->i_fop != &fat_file_operations)
+	{
+		printk(KERN_INFO "prfs_make_backup: %s: %s is not a new PRFS file: exiting\n", fname, fn2);
+		filp_close(copy_filp, NULL);
+		filp_close(original_filp, NULL);
 		return -1;
 	}
+	fat_set_backup(file_inode(copy_filp), &now);
+	/* The backup holds the direct writes already submitted */
+	inode_dio_wait(file_inode(original_filp));
 	printk(KERN_INFO "prfs_make_backup: %s: start copying files\n", fname);
 	vfs_copy_file_range(original_filp, 0, copy_filp, 0, i_size_read(original_filp->f_inode), 0);
 	printk(KERN_INFO "prfs_make_backup: %s: closing files\n", fname);
@@ -414,6 +434,37 @@ int get_prfs_mode()
 }
 EXPORT_SYMBOL_GPL(get_prfs_mode);
 
+// prfs_open_mode
+// decide what an open in PRFS mode prfs_mode has to do
+// writing: file opened for writing (file_readwrite)
+// backup: file is a backup file
+// created: file was just created by this open (file_justcreated)
+// returns PRFS_OPEN_ALLOW, PRFS_OPEN_BACKUP or PRFS_OPEN_DENY
+int prfs_open_mode(int prfs_mode, int writing, int backup, int created)
+{
+	switch (prfs_mode) 
+	{
+		case 0: // PRFS MODE
+			if (!writing)
+				return PRFS_OPEN_ALLOW;
+			// a backup file is WORM: only the open creating it may write
+			if (backup)
+				return created ? PRFS_OPEN_ALLOW : PRFS_OPEN_DENY;
+			// a new file has nothing to back up
+			return created ? PRFS_OPEN_ALLOW : PRFS_OPEN_BACKUP;
+		
+		case 1: // READ-ONLY
+			return writing ? PRFS_OPEN_DENY : PRFS_OPEN_ALLOW;
+		
+		case 2: // Only backup editable
+			return (writing && !backup) ? PRFS_OPEN_DENY : PRFS_OPEN_ALLOW;
+		
+		default:
+			return PRFS_OPEN_DENY;
+	}
+}
+EXPORT_SYMBOL_GPL(prfs_open_mode);
+
 int prfs_file_open(struct inode * inode, struct file * filp)
 {
 	int rtv; // return value
@@ -424,112 +475,72 @@ int prfs_file_open(struct inode * inode, struct file * filp)
 	printk(KERN_INFO "prfs_file_open: *** %s, f_flags: %04o\n", filp->f_path.dentry->d_iname, (int)filp->f_flags);
 	printk(KERN_INFO "prfs_file_open: %s, f_mode:  %04o\n", filp->f_path.dentry->d_iname, (int)filp->f_mode);
 	printk(KERN_INFO "prfs_file_open: %s, i_state: %lu\n", filp->f_path.dentry->d_iname, inode->i_state );
-	//printk(KERN_INFO "prfs_file_open: %s, d_lock: %i\n", filp->f_path.dentry->d_iname, (int)inode->i_flock->fl_flags ); // 
-	//printk(KERN_INFO "prfs_file_open: %s, f_mode: %04o, i_sate: %i, d_lock: %lu\n", filp->f_path.dentry->d_iname, (int)filp->f_mode, inode->i_state, (int)inode->i_lock.rlock ); // .rlock.raw_lock
 	
 	prfs_mode = get_prfs_mode();
 	
 	strncpy ( fn1, filp->f_path.dentry->d_iname, sizeof(fn1) );
-	//printk(KERN_INFO "prfs_file_open: fn1: %s\n", fn1);
 
-		
-	switch (prfs_mode) 
+	switch (prfs_open_mode(prfs_mode, file_readwrite(filp),
+			       fat_is_backup(inode), file_justcreated(filp)))
 	{
-		case 0: // PRFS MODE
-			//printk(KERN_INFO "prfs_file_open: ff: %i, &3: %i\n", ff, ff & 3);
-			if (file_readwrite(filp) == 1) // write 
-			{  // writing
-				printk(KERN_INFO "prfs_file_open: %s: write, need copy?\n", fn1);
-				if (filename_backup(fn1) == 1) 
-				{
-					// no copy
-					printk(KERN_INFO "prfs_file_open: %s: this is a backup filename: does not need copy.\n", fn1);
-					// Check whether backup file exist
-					if (file_justcreated(filp) == 0) {
-						printk(KERN_INFO "prfs_file_open: %s: this backup file does exist; is WORM: exit writing\n", fn1);
-						return -1;
-					}
-				} else {
-					// check whether is new file (then no copy needed)
-					if (file_justcreated(filp) == 1) 
-					{
-						printk(KERN_INFO "prfs_file_open: %s: this file does not (really) exist; no backup needed.\n", fn1);
-					} else {
-						// Make backup. If backup fails, block writing to the file
-						printk(KERN_INFO "prfs_file_open: %s: no backup filename, does need copy\n", fn1);
-						
-						fcres = prfs_make_backup(fn1);
-						if (fcres==-1) 
-						{
-							printk(KERN_INFO "prfs_file_open: %s: error making backup; access denied.\n", fn1);
-							return -1;
-						}
-		/*				
-						create_backup_filename_trailing(tme, sizeof tme);
-						snpres = snprintf(fn2, sizeof fn2, "%s%s", tme, fn1);
-						printk(KERN_INFO "prfs_file_open: %s fn2: %s, res: %i\n", fn1, fn2, snpres);
-						// https://stackoverflow.com/questions/60665151/clone-a-file-in-linux-kernel-module
-						//original_filp = fcheck(o_fd);
-						printk(KERN_INFO "prfs_file_open: open read file: %s\n", fn1);
-						original_filp = filp_open(fn1, O_RDONLY  , 0);
-						if (IS_ERR(original_filp) || (original_filp == NULL)) 
-						{
-							printk(KERN_INFO "prfs_file_open: %s: error opening fn1 in copy: exiting\n", fn1);
-							return -1;
-						}
-						printk(KERN_INFO "prfs_file_open: %s: open write file: %s\n", fn1, fn2);
-						copy_filp = filp_open(fn2, O_CREAT | O_RDWR  , 0644);
-						if (IS_ERR(copy_filp) || (copy_filp == NULL)) 
-						{
-							printk(KERN_INFO "prfs_file_open: %s: error opening %s in copy: exiting\n", fn1, fn2);
-							return -1;
-						}
-						printk(KERN_INFO "prfs_file_open: %s: start copying files\n", fn1);
-						vfs_copy_file_range(original_filp, 0, copy_filp, 0, i_size_read(original_filp->f_inode), 0);
-						printk(KERN_INFO "prfs_file_open: %s: closing files\n", fn1);
-						filp_close(copy_filp, NULL);
-						filp_close(original_filp, NULL);
-						printk(KERN_INFO "prfs_file_open: %s: finished copying\n", fn1);
-		*/
-					}
-				}
-			} else {
-				printk(KERN_INFO "prfs_file_open: %s: reading; allowed\n", fn1);
-			}
+		case PRFS_OPEN_ALLOW:
 			break;
-		
-		case 1: // READ-ONLY
-			if (file_readwrite(filp) == 1) // write 
-			{  // writing
+
+		case PRFS_OPEN_BACKUP:
+			// Make backup. If backup fails, block writing to the file
+			printk(KERN_INFO "prfs_file_open: %s: no backup filename, does need copy\n", fn1);
+			fcres = prfs_make_backup(fn1);
+			if (fcres==-1) 
+			{
+				printk(KERN_INFO "prfs_file_open: %s: error making backup; access denied.\n", fn1);
 				return -1;
-			}	
-			break;
-		
-		
-		case 2: // Only backup editable
-			if (file_readwrite(filp) == 1) // write 
-			{ 
-				if (filename_backup(fn1) == 0)  // This is not a backup file; so no writing allowed
-				{
-					return -1;
-				}					
 			}
 			break;
-		
+
 		default:
-			printk(KERN_INFO "prfs_file_open: %s: INVALIDE PRFS mode: %i\n", fn1, prfs_mode);
+			printk(KERN_INFO "prfs_file_open: %s: write access denied in PRFS mode %i\n", fn1, prfs_mode);
 			return -1;
 	}
-	
+
+	/* Errors are reported by fat_fs_error(), the map is only a cache */
+	if (MSDOS_SB(inode->i_sb)->options.mapahead)
+		fat_cache_map_inode(inode);
+
+	/* Direct I/O honours IOCB_NOWAIT, so io_uring can issue it inline */
+	filp->f_mode |= FMODE_NOWAIT;
+
 	rtv = generic_file_open(inode, filp);
 	return rtv;
 }
 
+static ssize_t fat_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	if (iocb->ki_flags & IOCB_DIRECT)
+		return fat_dio_read_iter(iocb, to);
+	return generic_file_read_iter(iocb, to);
+}
+
+static ssize_t fat_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	if (iocb->ki_flags & IOCB_DIRECT)
+		return fat_dio_write_iter(iocb, from);
+	if (MSDOS_SB(file_inode(iocb->ki_filp)->i_sb)->options.iomap)
+		return fat_iomap_write_iter(iocb, from);
+	return generic_file_write_iter(iocb, from);
+}
+
+static int fat_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	if (MSDOS_SB(file_inode(file)->i_sb)->options.iomap)
+		return fat_iomap_mmap(file, vma);
+	return generic_file_mmap(file, vma);
+}
+
 const struct file_operations fat_file_operations = {
 	.llseek		= generic_file_llseek,
-	.read_iter	= generic_file_read_iter,
-	.write_iter	= generic_file_write_iter,
-	.mmap		= generic_file_mmap,
+	.read_iter	= fat_file_read_iter,
+	.write_iter	= fat_file_write_iter,
+	.mmap		= fat_file_mmap,
 	.release	= fat_file_release,
 	.unlocked_ioctl	= fat_generic_ioctl,
 	.compat_ioctl	= compat_ptr_ioctl,
@@ -546,7 +557,10 @@ static int fat_cont_expand(struct inode *inode, loff_t size)
 	loff_t start = inode->i_size, count = size - inode->i_size;
 	int err;
 
-	err = generic_cont_expand_simple(inode, size);
+	if (MSDOS_SB(inode->i_sb)->options.iomap)
+		err = fat_iomap_expand(inode, size);
+	else
+		err = generic_cont_expand_simple(inode, size);
 	if (err)
 		goto out;
 
@@ -606,6 +620,10 @@ static long fat_fallocate(struct file *file, int mode,
 
 	inode_lock(inode);
 	if (mode & FALLOC_FL_KEEP_SIZE) {
+		/* The delayed clusters come first in the chain */
+		err = fat_alloc_delayed(inode);
+		if (err)
+			goto error;
 		ondisksize = inode->i_blocks << 9;
 		if ((offset + len) <= ondisksize)
 			goto error;
@@ -616,11 +634,7 @@ static long fat_fallocate(struct file *file, int mode,
 			sbi->cluster_bits;
 
 		/* Start the allocation.We are not zeroing out the clusters */
-		while (nr_cluster-- > 0) {
-			err = fat_add_cluster(inode);
-			if (err)
-				goto error;
-		}
+		err = fat_add_clusters(inode, nr_cluster);
 	} else {
 		if ((offset + len) <= i_size_read(inode))
 			goto error;
@@ -719,7 +733,11 @@ void fat_truncate_blocks(struct inode *inode, loff_t offset)
 
 	nr_clusters = (offset + (cluster_size - 1)) >> sbi->cluster_bits;
 
+	/* Keep writeback from allocating delayed clusters meanwhile */
+	mutex_lock(&MSDOS_I(inode)->i_da_mutex);
 	fat_free(inode, nr_clusters);
+	fat_release_reserved(inode, MSDOS_I(inode)->mmu_private);
+	mutex_unlock(&MSDOS_I(inode)->i_da_mutex);
 	fat_flush_inodes_prfs(inode->i_sb, inode, NULL);
 }
 
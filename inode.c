@@ -15,6 +15,8 @@
 #include <linux/module.h>
 #include <linux/pagemap.h>
 #include <linux/mpage.h>
+#include <linux/bio.h>
+#include <linux/writeback.h>
 #include <linux/vfs.h>
 #include <linux/seq_file.h>
 #include <linux/parser.h>
@@ -105,20 +107,77 @@ static struct fat_floppy_defaults {
 };
 
 int fat_add_cluster(struct inode *inode)
+{
+	return fat_add_clusters(inode, 1);
+}
+
+static int __fat_add_clusters(struct inode *inode, int nr_cluster,
+			      bool reserved)
 {
 	int err, cluster;
 
-	err = fat_alloc_clusters(inode, &cluster, 1);
+	err = fat_alloc_chain(inode, nr_cluster, &cluster, reserved);
 	if (err)
 		return err;
 	/* FIXME: this cluster should be added after data of this
 	 * cluster is writed */
-	err = fat_chain_add(inode, cluster, 1);
+	err = fat_chain_add(inode, cluster, nr_cluster);
 	if (err)
 		fat_free_clusters_prfs(inode, cluster);
+	else if (reserved)
+		fat_release_clusters(inode->i_sb, nr_cluster);
+	return err;
+}
+
+/* Append @nr_cluster clusters to @inode, as contiguous as possible. */
+int fat_add_clusters(struct inode *inode, int nr_cluster)
+{
+	return __fat_add_clusters(inode, nr_cluster, false);
+}
+
+/*
+ * Delayed allocation ("delalloc" option): ->write_begin() only reserves
+ * the clusters past the allocated ones and leaves their buffers unmapped
+ * with BH_Delay set. The reserved clusters are allocated as one chain
+ * when the pages are written back, by which time the file size is known.
+ */
+int fat_alloc_delayed(struct inode *inode)
+{
+	struct msdos_inode_info *ei = MSDOS_I(inode);
+	int err = 0;
+
+	mutex_lock(&ei->i_da_mutex);
+	if (ei->i_reserved) {
+		/* On failure the clusters stay reserved, for a retry */
+		err = __fat_add_clusters(inode, ei->i_reserved, true);
+		if (!err)
+			ei->i_reserved = 0;
+	}
+	mutex_unlock(&ei->i_da_mutex);
 	return err;
 }
 
+/*
+ * Drop the reservations for the clusters past @size, after a truncate or
+ * a failed write. Caller must hold ->i_da_mutex.
+ */
+void fat_release_reserved(struct inode *inode, loff_t size)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(inode->i_sb);
+	struct msdos_inode_info *ei = MSDOS_I(inode);
+	int nr_alloc, nr_keep;
+
+	lockdep_assert_held(&ei->i_da_mutex);
+
+	nr_alloc = inode->i_blocks >> (sbi->cluster_bits - 9);
+	nr_keep = (size + (sbi->cluster_size - 1)) >> sbi->cluster_bits;
+	nr_keep = max(nr_keep - nr_alloc, 0);
+	if (ei->i_reserved > nr_keep) {
+		fat_release_clusters(inode->i_sb, ei->i_reserved - nr_keep);
+		ei->i_reserved = nr_keep;
+	}
+}
+
 static inline int __fat_get_block(struct inode *inode, sector_t iblock,
 				  unsigned long *max_blocks,
 				  struct buffer_head *bh_result, int create)
@@ -133,6 +192,8 @@ static inline int __fat_get_block(struct inode *inode, sector_t iblock,
 	if (err)
 		return err;
 	if (phys) {
+		if (buffer_delay(bh_result))
+			clear_buffer_delay(bh_result);
 		map_bh(bh_result, sb, phys);
 		*max_blocks = min(mapped_blocks, *max_blocks);
 		return 0;
@@ -140,6 +201,26 @@ static inline int __fat_get_block(struct inode *inode, sector_t iblock,
 	if (!create)
 		return 0;
 
+	if (buffer_delay(bh_result)) {
+		/* Written back without ->writepages(), allocate it now */
+		err = fat_alloc_delayed(inode);
+		if (err)
+			return err;
+		err = fat_bmap(inode, iblock, &phys, &mapped_blocks, create,
+			       false);
+		if (err)
+			return err;
+		if (!phys) {
+			fat_fs_error(sb, "delayed block not allocated (i_pos %lld)",
+				     MSDOS_I(inode)->i_pos);
+			return -EIO;
+		}
+		clear_buffer_delay(bh_result);
+		map_bh(bh_result, sb, phys);
+		*max_blocks = min(mapped_blocks, *max_blocks);
+		return 0;
+	}
+
 	if (iblock != MSDOS_I(inode)->mmu_private >> sb->s_blocksize_bits) {
 		fat_fs_error(sb, "corrupted file size (i_pos %lld, %lld)",
 			MSDOS_I(inode)->i_pos, MSDOS_I(inode)->mmu_private);
@@ -197,47 +278,261 @@ static int fat_get_block(struct inode *inode, sector_t iblock,
 	return 0;
 }
 
+/*
+ * ->write_begin() get_block of the "delalloc" option: the blocks of the
+ * allocated clusters (fallocate) are mapped as usual, the blocks past
+ * them get a reservation instead of a cluster.
+ */
+static int fat_get_block_delay(struct inode *inode, sector_t iblock,
+			       struct buffer_head *bh_result, int create)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	struct msdos_inode_info *ei = MSDOS_I(inode);
+	sector_t last_block;
+	int err = 0;
+
+	/* Reserved by an earlier write */
+	if (buffer_delay(bh_result))
+		return 0;
+
+	mutex_lock(&ei->i_da_mutex);
+	last_block = inode->i_blocks >> (sb->s_blocksize_bits - 9);
+	if (iblock < last_block) {
+		mutex_unlock(&ei->i_da_mutex);
+		return fat_get_block(inode, iblock, bh_result, create);
+	}
+
+	if (iblock != ei->mmu_private >> sb->s_blocksize_bits) {
+		mutex_unlock(&ei->i_da_mutex);
+		fat_fs_error(sb, "corrupted file size (i_pos %lld, %lld)",
+			ei->i_pos, ei->mmu_private);
+		return -EIO;
+	}
+
+	/* the first block of a cluster reserves the whole cluster */
+	last_block += (sector_t)ei->i_reserved * sbi->sec_per_clus;
+	if (iblock >= last_block) {
+		err = fat_reserve_clusters(sb, 1);
+		if (!err)
+			ei->i_reserved++;
+	}
+	mutex_unlock(&ei->i_da_mutex);
+	if (err)
+		return err;
+
+	ei->mmu_private += sb->s_blocksize;
+	/*
+	 * Nothing to read from disk. BH_New can't be used to have the
+	 * caller zero it, as the buffer isn't mapped.
+	 */
+	zero_user(bh_result->b_page, bh_offset(bh_result), bh_result->b_size);
+	set_buffer_uptodate(bh_result);
+	set_buffer_delay(bh_result);
+	return 0;
+}
+
 static int fat_writepage(struct page *page, struct writeback_control *wbc)
 {
 	printk(KERN_INFO "fate_writepage function...\n");
 	return block_write_full_page(page, fat_get_block, wbc);
 }
 
+/*
+ * Writeback maps the pages a run of contiguous clusters at a time, from
+ * the cluster cache, and adds them to one bio for as long as they follow
+ * each other on disk. A page whose buffers aren't all dirty, or which
+ * straddles two runs, goes through block_write_full_page() instead.
+ */
+struct fat_wb_ctx {
+	struct bio *bio;
+	sector_t next_phys;	/* block following the bio */
+	sector_t ext_block;	/* first file block of the run */
+	sector_t ext_phys;	/* its block on disk */
+	unsigned long ext_len;	/* blocks in the run, 0 if none */
+	unsigned int cache_id;	/* cluster cache the run came from */
+};
+
+static void fat_wb_submit(struct fat_wb_ctx *ctx)
+{
+	if (ctx->bio) {
+		submit_bio(ctx->bio);
+		ctx->bio = NULL;
+	}
+}
+
+static void fat_end_bio_write(struct bio *bio)
+{
+	int err = blk_status_to_errno(bio->bi_status);
+	struct bvec_iter_all iter_all;
+	struct bio_vec *bv;
+
+	bio_for_each_segment_all(bv, bio, iter_all)
+		page_endio(bv->bv_page, true, err);
+	bio_put(bio);
+}
+
+/* Map file block @block, looking up the run holding it if needed. */
+static int fat_wb_map(struct inode *inode, struct fat_wb_ctx *ctx,
+		      sector_t block, sector_t *phys)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	const unsigned int bits = sbi->cluster_bits - sb->s_blocksize_bits;
+	unsigned int id = READ_ONCE(MSDOS_I(inode)->cache_valid_id);
+	int cluster, last, dclus, len, err;
+
+	if (ctx->ext_len && id == ctx->cache_id && block >= ctx->ext_block &&
+	    block < ctx->ext_block + ctx->ext_len)
+		goto out;
+
+	/* No further than the file and one full bio */
+	cluster = block >> bits;
+	last = min_t(loff_t, inode->i_blocks >> (sbi->cluster_bits - 9),
+		     (i_size_read(inode) + sbi->cluster_size - 1) >>
+		     sbi->cluster_bits);
+	if (cluster >= last)
+		return -EIO;
+	last = min_t(loff_t, last, cluster +
+		     max(((loff_t)BIO_MAX_VECS << PAGE_SHIFT) >>
+			 sbi->cluster_bits, 1LL));
+
+	ctx->ext_len = 0;
+	ctx->cache_id = id;
+	err = fat_get_extent(inode, cluster, last - cluster, &dclus, &len);
+	if (err)
+		return err;
+	ctx->ext_block = (sector_t)cluster << bits;
+	ctx->ext_phys = fat_clus_to_blknr(sbi, dclus);
+	ctx->ext_len = (unsigned long)len << bits;
+out:
+	*phys = ctx->ext_phys + (block - ctx->ext_block);
+	return 0;
+}
+
+static int fat_writepage_extent(struct page *page,
+				struct writeback_control *wbc, void *data)
+{
+	struct fat_wb_ctx *ctx = data;
+	struct inode *inode = page->mapping->host;
+	struct super_block *sb = inode->i_sb;
+	const unsigned int blkbits = inode->i_blkbits;
+	const unsigned int blocks_per_page = PAGE_SIZE >> blkbits;
+	const loff_t i_size = i_size_read(inode);
+	const pgoff_t end_index = i_size >> PAGE_SHIFT;
+	unsigned int nr_blocks = blocks_per_page, nr_vecs, i;
+	sector_t block = (sector_t)page->index << (PAGE_SHIFT - blkbits);
+	struct buffer_head *head, *bh;
+	sector_t phys;
+	int err;
+
+	if (page->index >= end_index) {
+		unsigned int offset = i_size & (PAGE_SIZE - 1);
+
+		/* Outside the file, let block_write_full_page() drop it */
+		if (page->index > end_index || !offset)
+			goto confused;
+		nr_blocks = (offset + (1 << blkbits) - 1) >> blkbits;
+	}
+
+	if (fat_wb_map(inode, ctx, block, &phys) ||
+	    block + nr_blocks > ctx->ext_block + ctx->ext_len)
+		goto confused;
+
+	if (page_has_buffers(page)) {
+		/*
+		 * The buffers inside the file must all be dirty, mapped where
+		 * the run says, or delayed (allocated by fat_writepages()).
+		 */
+		head = page_buffers(page);
+		bh = head;
+		i = 0;
+		do {
+			if (i >= nr_blocks)
+				break;
+			if (!buffer_dirty(bh) || !buffer_uptodate(bh))
+				goto confused;
+			if (buffer_mapped(bh) ? bh->b_blocknr != phys + i :
+			    !buffer_delay(bh))
+				goto confused;
+			i++;
+		} while ((bh = bh->b_this_page) != head);
+
+		bh = head;
+		i = 0;
+		do {
+			if (i < nr_blocks && !buffer_mapped(bh)) {
+				clear_buffer_delay(bh);
+				map_bh(bh, sb, phys + i);
+			}
+			clear_buffer_dirty(bh);
+			i++;
+		} while ((bh = bh->b_this_page) != head);
+	} else if (!PageUptodate(page)) {
+		goto confused;
+	}
+
+	if (nr_blocks < blocks_per_page)
+		zero_user_segment(page, nr_blocks << blkbits, PAGE_SIZE);
+
+	if (ctx->bio && phys != ctx->next_phys)
+		fat_wb_submit(ctx);
+alloc_new:
+	if (!ctx->bio) {
+		nr_vecs = (ctx->ext_block + ctx->ext_len - block) >>
+			  (PAGE_SHIFT - blkbits);
+		nr_vecs = clamp_t(unsigned int, nr_vecs, 1, BIO_MAX_VECS);
+		ctx->bio = bio_alloc(sb->s_bdev, nr_vecs,
+				     REQ_OP_WRITE | wbc_to_write_flags(wbc),
+				     GFP_NOFS);
+		ctx->bio->bi_iter.bi_sector = phys << (blkbits - 9);
+		ctx->bio->bi_end_io = fat_end_bio_write;
+		wbc_init_bio(wbc, ctx->bio);
+	}
+
+	wbc_account_cgroup_owner(wbc, page, PAGE_SIZE);
+	if (bio_add_page(ctx->bio, page, nr_blocks << blkbits, 0) <
+	    nr_blocks << blkbits) {
+		fat_wb_submit(ctx);
+		goto alloc_new;
+	}
+	ctx->next_phys = phys + nr_blocks;
+
+	BUG_ON(PageWriteback(page));
+	set_page_writeback(page);
+	unlock_page(page);
+	/* The last page of the file ends the bio */
+	if (nr_blocks < blocks_per_page)
+		fat_wb_submit(ctx);
+	return 0;
+
+confused:
+	fat_wb_submit(ctx);
+	err = block_write_full_page(page, fat_get_block, wbc);
+	mapping_set_error(page->mapping, err);
+	return err;
+}
+
 static int fat_writepages(struct address_space *mapping,
 			  struct writeback_control *wbc)
 {
-// https://stackoverflow.com/questions/8556461/how-to-obtain-a-pathname-or-dentry-or-struct-file-from-a-given-inode
-// https://stackoverflow.com/questions/29571210/list-first-entry-array-of-linked-list-linux-kernel
-	//struct dentry *tmp_dentry = NULL;
-	struct inode *tmp_inode = mapping->host;
-	//struct hlist_head tmp_lh = (tmp_inode->i_dentry);
-	//struct hlist_head *tmp_list = NULL;  // cursor
-	//struct hlist_head *tmp_dentrylist = NULL;
-	//struct hlist_node *tmp_alias;
-	
-	struct dentry *de;
-
-	hlist_for_each_entry(de, &tmp_inode->i_dentry, d_u.d_alias) {
-		printk(KERN_INFO "fat_writepages (S) function: %lu %s\n", tmp_inode->i_ino, de->d_name.name);
-		//de->d_flags |= DCACHE_DONTCACHE;
-		//spin_unlock(&de->d_lock);
-	}
-
-	//tmp_dentry = list_first_entry(tmp_list, struct dentry, d_name);
-	//hlist_for_each(tmp_list, &(tmp_inode->i_dentry))
-	//for (pos = (head)->next; pos != (head); pos = pos->next)
-	//for (tmp_list = tmp_inode->i_dentry->next; tmp_list != tmp_inode->i_dentry; tmp_list = tmp_list->next)
-	//hlist_for_each(tmp_list, &(tmp_inode->i_dentry))
-	//{
-		//tmp_dentry = hlist_entry(tmp_inode, struct dentry, d_name);
-		//printk(KERN_INFO "fat_writepages (S) function 1: %s\n", tmp_inode->i_dentry.first->d_name);
-		//tmp_dentry = hlist_entry(&(tmp_inode->i_dentry), struct dentry, d_name);
-	//	tmp_dentry = hlist_entry(tmp_list, struct dentry, d_name);
-	//	printk(KERN_INFO "fat_writepages (S) function: %s\n", tmp_dentry->d_name);
-	//	printk(KERN_INFO "fat_writepages (S) function: %s\n", hlist_entry(tmp_list, struct dentry, d_name) );
-	//}
-	//printk(KERN_INFO "fat_writepages (S) function: %s\n", tmp_dentry->d_iname);
-	return mpage_writepages(mapping, wbc, fat_get_block);
+	struct inode *inode = mapping->host;
+	struct fat_wb_ctx ctx = { };
+	struct blk_plug plug;
+	int err;
+
+	/* Allocate the whole delayed range at once, as contiguous as can be */
+	if (MSDOS_I(inode)->i_reserved) {
+		err = fat_alloc_delayed(inode);
+		if (err)
+			return err;
+	}
+
+	blk_start_plug(&plug);
+	err = write_cache_pages(mapping, wbc, fat_writepage_extent, &ctx);
+	fat_wb_submit(&ctx);
+	blk_finish_plug(&plug);
+	return err;
 }
 
 static int fat_read_folio(struct file *file, struct folio *folio)
@@ -266,6 +561,7 @@ static int fat_write_begin_prfs(struct file *file, struct address_space *mapping
 			loff_t pos, unsigned len,
 			struct page **pagep, void **fsdata)
 {
+	struct msdos_sb_info *sbi = MSDOS_SB(mapping->host->i_sb);
 	int err;
         //struct file *o_fp;
         //char txt[20];
@@ -287,7 +583,8 @@ static int fat_write_begin_prfs(struct file *file, struct address_space *mapping
 */
 	*pagep = NULL;
 	err = cont_write_begin(file, mapping, pos, len,
-				pagep, fsdata, fat_get_block,
+				pagep, fsdata, sbi->options.delalloc ?
+				fat_get_block_delay : fat_get_block,
 				&MSDOS_I(mapping->host)->mmu_private);
 	if (err < 0)
 		fat_write_failed(mapping, pos + len);
@@ -314,43 +611,6 @@ static int fat_write_end_prfs(struct file *file, struct address_space *mapping,
 	return err;
 }
 
-static ssize_t fat_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
-{
-	struct file *file = iocb->ki_filp;
-	struct address_space *mapping = file->f_mapping;
-	struct inode *inode = mapping->host;
-	size_t count = iov_iter_count(iter);
-	loff_t offset = iocb->ki_pos;
-	ssize_t ret;
-
-	printk(KERN_INFO "fat_direct_IO function...\n");
-
-	if (iov_iter_rw(iter) == WRITE) {
-		/*
-		 * FIXME: blockdev_direct_IO() doesn't use ->write_begin(),
-		 * so we need to update the ->mmu_private to block boundary.
-		 *
-		 * But we must fill the remaining area or hole by nul for
-		 * updating ->mmu_private.
-		 *
-		 * Return 0, and fallback to normal buffered write.
-		 */
-		loff_t size = offset + count;
-		if (MSDOS_I(inode)->mmu_private < size)
-			return 0;
-	}
-
-	/*
-	 * FAT need to use the DIO_LOCKING for avoiding the race
-	 * condition of fat_get_block() and ->truncate().
-	 */
-	ret = blockdev_direct_IO(iocb, inode, iter, fat_get_block);
-	if (ret < 0 && iov_iter_rw(iter) == WRITE)
-		fat_write_failed(mapping, offset + count);
-
-	return ret;
-}
-
 static int fat_get_block_bmap(struct inode *inode, sector_t iblock,
 		struct buffer_head *bh_result, int create)
 {
@@ -399,6 +659,8 @@ static sector_t _fat_bmap(struct address_space *mapping, sector_t block)
  */
 int fat_block_truncate_page(struct inode *inode, loff_t from)
 {
+	if (MSDOS_SB(inode->i_sb)->options.iomap)
+		return fat_iomap_truncate_page(inode, from);
 	return block_truncate_page(inode->i_mapping, from, fat_get_block);
 }
 
@@ -411,7 +673,7 @@ static const struct address_space_operations fat_aops = {
 	.writepages	= fat_writepages,
 	.write_begin	= fat_write_begin_prfs,
 	.write_end	= fat_write_end_prfs,
-	.direct_IO	= fat_direct_IO,
+	.direct_IO	= noop_direct_IO,
 	.bmap		= _fat_bmap
 };
 
@@ -433,37 +695,91 @@ static const struct address_space_operations fat_aops = {
  *			If it is we silently return. If it isn't we do bread(),
  *			check if the location is still valid and retry if it
  *			isn't. Otherwise we do changes.
- *		5. Spinlock is used to protect hash/unhash/location check/lookup
+ *		5. The bit lock of the hash bucket of i_pos protects
+ *			hash/unhash/location check/lookup at that i_pos.
  *		6. fat_evict_inode() unhashes the F-d-c entry.
  *		7. lookup() and readdir() do igrab() if they find a F-d-c entry
  *			and consider negative result as cache miss.
  */
 
-static void fat_hash_init(struct super_block *sb)
+/*
+ * The hash tables get about a bucket per 16 clusters, within limits, so
+ * that the chains stay short however many inodes are cached. Each bucket
+ * of the inode hash has its own bit lock; the directory hash, only used
+ * for NFS, keeps a single lock as i_logstart changes while hashed.
+ */
+static int fat_hash_init(struct super_block *sb)
 {
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
-	int i;
+	unsigned int i, size;
+
+	sbi->hash_bits = clamp_t(int, ilog2(sbi->max_cluster) - 4,
+				 FAT_HASH_BITS, FAT_HASH_MAX_BITS);
+	size = 1U << sbi->hash_bits;
+	sbi->inode_hashtable = kvmalloc_array(size,
+					      sizeof(*sbi->inode_hashtable),
+					      GFP_KERNEL);
+	sbi->dir_hashtable = kvmalloc_array(size, sizeof(*sbi->dir_hashtable),
+					    GFP_KERNEL);
+	if (!sbi->inode_hashtable || !sbi->dir_hashtable)
+		return -ENOMEM;
+	for (i = 0; i < size; i++) {
+		INIT_HLIST_BL_HEAD(&sbi->inode_hashtable[i]);
+		INIT_HLIST_HEAD(&sbi->dir_hashtable[i]);
+	}
+	spin_lock_init(&sbi->dir_hash_lock);
+	return 0;
+}
 
-	spin_lock_init(&sbi->inode_hash_lock);
-	for (i = 0; i < FAT_HASH_SIZE; i++)
-		INIT_HLIST_HEAD(&sbi->inode_hashtable[i]);
+static void fat_hash_free(struct msdos_sb_info *sbi)
+{
+	kvfree(sbi->inode_hashtable);
+	kvfree(sbi->dir_hashtable);
+	sbi->inode_hashtable = NULL;
+	sbi->dir_hashtable = NULL;
 }
 
-static inline unsigned long fat_hash(loff_t i_pos)
+static inline struct hlist_bl_head *fat_hash(struct msdos_sb_info *sbi,
+					     loff_t i_pos)
 {
-	return hash_32(i_pos, FAT_HASH_BITS);
+	return &sbi->inode_hashtable[hash_64(i_pos, sbi->hash_bits)];
 }
 
-static void dir_hash_init(struct super_block *sb)
+/* Under the bucket lock; see fat_i_pos_read() */
+static inline void fat_i_pos_write(struct inode *inode, loff_t i_pos)
 {
-	struct msdos_sb_info *sbi = MSDOS_SB(sb);
-	int i;
+#if BITS_PER_LONG == 32
+	spin_lock(&inode->i_lock);
+#endif
+	MSDOS_I(inode)->i_pos = i_pos;
+#if BITS_PER_LONG == 32
+	spin_unlock(&inode->i_lock);
+#endif
+}
 
-	spin_lock_init(&sbi->dir_hash_lock);
-	for (i = 0; i < FAT_HASH_SIZE; i++)
-		INIT_HLIST_HEAD(&sbi->dir_hashtable[i]);
+/* If NFS support is enabled, cache the mapping of start cluster
+ * to directory inode. This is used during reconnection of
+ * dentries to the filesystem root.
+ */
+static void fat_attach_dir(struct inode *inode)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(inode->i_sb);
+
+	if (S_ISDIR(inode->i_mode) && sbi->options.nfs) {
+		struct hlist_head *d_head;
+		d_head = fat_dir_hash(sbi, MSDOS_I(inode)->i_logstart);
+
+		spin_lock(&sbi->dir_hash_lock);
+		hlist_add_head(&MSDOS_I(inode)->i_dir_hash, d_head);
+		spin_unlock(&sbi->dir_hash_lock);
+	}
 }
 
+/*
+ * Hash @inode at @i_pos. An inode found there already was built from the
+ * entry while it changed hands, which rename's write section rules out:
+ * it is unhashed, so that its writeback can't overwrite the entry.
+ */
 void fat_attach_prfs(struct inode *inode, loff_t i_pos)
 {
 	struct msdos_sb_info *sbi = MSDOS_SB(inode->i_sb);
@@ -471,40 +787,86 @@ void fat_attach_prfs(struct inode *inode, loff_t i_pos)
 	printk(KERN_INFO "fat_attach_prfs function...\n");
 
 	if (inode->i_ino != MSDOS_ROOT_INO) {
-		struct hlist_head *head =   sbi->inode_hashtable
-					  + fat_hash(i_pos);
-
-		spin_lock(&sbi->inode_hash_lock);
-		MSDOS_I(inode)->i_pos = i_pos;
-		hlist_add_head(&MSDOS_I(inode)->i_fat_hash, head);
-		spin_unlock(&sbi->inode_hash_lock);
+		struct hlist_bl_head *head = fat_hash(sbi, i_pos);
+		struct hlist_bl_node *pos, *n;
+		struct msdos_inode_info *i;
+
+		hlist_bl_lock(head);
+		hlist_bl_for_each_entry_safe(i, pos, n, head, i_fat_hash) {
+			if (i->i_pos != i_pos)
+				continue;
+			WARN_ON_ONCE(1);
+			fat_i_pos_write(&i->vfs_inode, 0);
+			hlist_bl_del_init(&i->i_fat_hash);
+		}
+		fat_i_pos_write(inode, i_pos);
+		hlist_bl_add_head(&MSDOS_I(inode)->i_fat_hash, head);
+		hlist_bl_unlock(head);
 	}
 
-	/* If NFS support is enabled, cache the mapping of start cluster
-	 * to directory inode. This is used during reconnection of
-	 * dentries to the filesystem root.
-	 */
-	if (S_ISDIR(inode->i_mode) && sbi->options.nfs) {
-		struct hlist_head *d_head = sbi->dir_hashtable;
-		d_head += fat_dir_hash(MSDOS_I(inode)->i_logstart);
+	fat_attach_dir(inode);
+}
+EXPORT_SYMBOL_GPL(fat_attach_prfs);
 
-		spin_lock(&sbi->dir_hash_lock);
-		hlist_add_head(&MSDOS_I(inode)->i_dir_hash, d_head);
-		spin_unlock(&sbi->dir_hash_lock);
+/*
+ * Hash a new inode at i_pos, unless a lookup running in parallel got
+ * there first: its inode is returned then. Without the directory lock
+ * (dir != NULL), give up with -EAGAIN if the directory changed since
+ * seq, as the entry i_pos came from may be gone.
+ */
+static struct inode *fat_attach_new(struct inode *inode, loff_t i_pos,
+				    struct inode *dir, unsigned int seq)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(inode->i_sb);
+	struct hlist_bl_head *head = fat_hash(sbi, i_pos);
+	struct hlist_bl_node *pos;
+	struct msdos_inode_info *i;
+	struct inode *alias = NULL;
+
+	hlist_bl_lock(head);
+	if (dir && fat_dir_read_retry(dir, seq)) {
+		hlist_bl_unlock(head);
+		return ERR_PTR(-EAGAIN);
 	}
+	hlist_bl_for_each_entry(i, pos, head, i_fat_hash) {
+		if (i->i_pos != i_pos)
+			continue;
+		alias = igrab(&i->vfs_inode);
+		if (alias)
+			break;
+	}
+	if (!alias) {
+		fat_i_pos_write(inode, i_pos);
+		hlist_bl_add_head(&MSDOS_I(inode)->i_fat_hash, head);
+	}
+	hlist_bl_unlock(head);
+	if (alias)
+		return alias;
+
+	fat_attach_dir(inode);
+	return inode;
 }
-EXPORT_SYMBOL_GPL(fat_attach_prfs);
 
 void fat_detach_prfs(struct inode *inode)
 {
 	struct msdos_sb_info *sbi = MSDOS_SB(inode->i_sb);
+	struct hlist_bl_head *head;
+	loff_t i_pos;
 
 	printk(KERN_INFO "fat_detach_prfs function.\n");
 
-	spin_lock(&sbi->inode_hash_lock);
-	MSDOS_I(inode)->i_pos = 0;
-	hlist_del_init(&MSDOS_I(inode)->i_fat_hash);
-	spin_unlock(&sbi->inode_hash_lock);
+	/* i_pos only changes under the lock of its bucket */
+	for (;;) {
+		i_pos = fat_i_pos_read(sbi, inode);
+		head = fat_hash(sbi, i_pos);
+		hlist_bl_lock(head);
+		if (fat_i_pos_read(sbi, inode) == i_pos)
+			break;
+		hlist_bl_unlock(head);
+	}
+	fat_i_pos_write(inode, 0);
+	hlist_bl_del_init(&MSDOS_I(inode)->i_fat_hash);
+	hlist_bl_unlock(head);
 
 	if (S_ISDIR(inode->i_mode) && sbi->options.nfs) {
 		spin_lock(&sbi->dir_hash_lock);
@@ -517,12 +879,13 @@ EXPORT_SYMBOL_GPL(fat_detach_prfs);
 struct inode *fat_iget(struct super_block *sb, loff_t i_pos)
 {
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
-	struct hlist_head *head = sbi->inode_hashtable + fat_hash(i_pos);
+	struct hlist_bl_head *head = fat_hash(sbi, i_pos);
+	struct hlist_bl_node *pos;
 	struct msdos_inode_info *i;
 	struct inode *inode = NULL;
 
-	spin_lock(&sbi->inode_hash_lock);
-	hlist_for_each_entry(i, head, i_fat_hash) {
+	hlist_bl_lock(head);
+	hlist_bl_for_each_entry(i, pos, head, i_fat_hash) {
 		BUG_ON(i->vfs_inode.i_sb != sb);
 		if (i->i_pos != i_pos)
 			continue;
@@ -530,7 +893,7 @@ struct inode *fat_iget(struct super_block *sb, loff_t i_pos)
 		if (inode)
 			break;
 	}
-	spin_unlock(&sbi->inode_hash_lock);
+	hlist_bl_unlock(head);
 	return inode;
 }
 
@@ -579,6 +942,22 @@ static int fat_validate_dir(struct inode *dir)
 	return 0;
 }
 
+/* Load the PRFS backup time, see FAT_PRFS_BACKUP. */
+static void fat_fill_backup_time(struct inode *inode,
+				 struct msdos_dir_entry *de)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(inode->i_sb);
+	struct msdos_inode_info *ei = MSDOS_I(inode);
+	u16 usec = le16_to_cpu(de->adate);
+
+	fat_time_fat2unix_prfs(sbi, &ei->i_crtime, de->ctime, de->cdate,
+			       de->ctime_cs);
+	if (usec < FAT_PRFS_USEC_PER_CS)
+		ei->i_crtime.tv_nsec += usec * NSEC_PER_USEC;
+	ei->i_backup_time = timespec64_to_ns(&ei->i_crtime);
+	inode->i_atime = fat_truncate_atime(sbi, &inode->i_mtime);
+}
+
 /* doesn't deal with root inode */
 int fat_fill_inode(struct inode *inode, struct msdos_dir_entry *de)
 {
@@ -620,7 +999,11 @@ int fat_fill_inode(struct inode *inode, struct msdos_dir_entry *de)
 		inode->i_size = le32_to_cpu(de->size);
 		inode->i_op = &fat_file_inode_operations;
 		inode->i_fop = &fat_file_operations;
-		inode->i_mapping->a_ops = &fat_aops;
+		if (sbi->options.iomap) {
+			inode->i_mapping->a_ops = &fat_iomap_aops;
+			mapping_set_large_folios(inode->i_mapping);
+		} else
+			inode->i_mapping->a_ops = &fat_aops;
 		MSDOS_I(inode)->mmu_private = inode->i_size;
 	}
 	if (de->attr & ATTR_SYS) {
@@ -628,13 +1011,16 @@ int fat_fill_inode(struct inode *inode, struct msdos_dir_entry *de)
 			inode->i_flags |= S_IMMUTABLE;
 	}
 	fat_save_attrs(inode, de->attr);
+	MSDOS_I(inode)->i_backup = !!(de->lcase & FAT_PRFS_BACKUP);
 
 	inode->i_blocks = ((inode->i_size + (sbi->cluster_size - 1))
 			   & ~((loff_t)sbi->cluster_size - 1)) >> 9;
 
 	fat_time_fat2unix_prfs(sbi, &inode->i_mtime, de->time, de->date, 0);
 	inode->i_ctime = inode->i_mtime;
-	if (sbi->options.isvfat) {
+	if (sbi->options.isvfat && MSDOS_I(inode)->i_backup) {
+		fat_fill_backup_time(inode, de);
+	} else if (sbi->options.isvfat) {
 		fat_time_fat2unix_prfs(sbi, &inode->i_atime, 0, de->adate, 0);
 		fat_time_fat2unix_prfs(sbi, &MSDOS_I(inode)->i_crtime, de->ctime,
 				  de->cdate, de->ctime_cs);
@@ -644,6 +1030,23 @@ int fat_fill_inode(struct inode *inode, struct msdos_dir_entry *de)
 	return 0;
 }
 
+/*
+ * Turn a freshly created file into a PRFS backup copy made at @ts. The
+ * flag and time reach the directory entry with the next inode write.
+ */
+void fat_set_backup(struct inode *inode, const struct timespec64 *ts)
+{
+	struct msdos_inode_info *ei = MSDOS_I(inode);
+
+	/* Keep in memory what the directory entry can hold. */
+	ei->i_crtime.tv_sec = ts->tv_sec;
+	ei->i_crtime.tv_nsec = ts->tv_nsec - ts->tv_nsec % NSEC_PER_USEC;
+	ei->i_backup_time = timespec64_to_ns(&ei->i_crtime);
+	ei->i_backup = 1;
+	mark_inode_dirty(inode);
+}
+EXPORT_SYMBOL_GPL(fat_set_backup);
+
 static inline void fat_lock_build_inode(struct msdos_sb_info *sbi)
 {
 	if (sbi->options.nfs == FAT_NFS_NOSTALE_RO)
@@ -656,14 +1059,13 @@ static inline void fat_unlock_build_inode(struct msdos_sb_info *sbi)
 		mutex_unlock(&sbi->nfs_build_inode_lock);
 }
 
-struct inode *fat_build_inode_prfs(struct super_block *sb,
-			struct msdos_dir_entry *de, loff_t i_pos)
+static struct inode *__fat_build_inode(struct super_block *sb,
+			struct msdos_dir_entry *de, loff_t i_pos,
+			struct inode *dir, unsigned int seq)
 {
-	struct inode *inode;
+	struct inode *inode, *alias;
 	int err;
 
-	printk(KERN_INFO "fat_build_inode_prfs function...\n");
-
 	fat_lock_build_inode(MSDOS_SB(sb));
 	inode = fat_iget(sb, i_pos);
 	if (inode)
@@ -681,15 +1083,40 @@ struct inode *fat_build_inode_prfs(struct super_block *sb,
 		inode = ERR_PTR(err);
 		goto out;
 	}
-	fat_attach_prfs(inode, i_pos);
+	alias = fat_attach_new(inode, i_pos, dir, seq);
+	if (alias != inode) {
+		iput(inode);
+		inode = alias;
+		goto out;
+	}
 	insert_inode_hash(inode);
 out:
 	fat_unlock_build_inode(MSDOS_SB(sb));
 	return inode;
 }
 
+struct inode *fat_build_inode_prfs(struct super_block *sb,
+			struct msdos_dir_entry *de, loff_t i_pos)
+{
+	printk(KERN_INFO "fat_build_inode_prfs function...\n");
+
+	return __fat_build_inode(sb, de, i_pos, NULL, 0);
+}
+
 EXPORT_SYMBOL_GPL(fat_build_inode_prfs);
 
+/*
+ * For lookup without the lock of dir: de was read at seq, see
+ * fat_dir_read_begin(). Returns -EAGAIN if dir changed since.
+ */
+struct inode *fat_build_inode_nolock(struct super_block *sb,
+			struct msdos_dir_entry *de, loff_t i_pos,
+			struct inode *dir, unsigned int seq)
+{
+	return __fat_build_inode(sb, de, i_pos, dir, seq);
+}
+EXPORT_SYMBOL_GPL(fat_build_inode_nolock);
+
 static int __fat_write_inode(struct inode *inode, int wait);
 
 static void fat_free_eofblocks(struct inode *inode)
@@ -726,10 +1153,15 @@ static void fat_evict_inode(struct inode *inode)
 		fat_truncate_blocks(inode, 0);
 	} else
 		fat_free_eofblocks(inode);
+	/* Delayed pages dropped with the page cache */
+	mutex_lock(&MSDOS_I(inode)->i_da_mutex);
+	fat_release_reserved(inode, 0);
+	mutex_unlock(&MSDOS_I(inode)->i_da_mutex);
 
 	invalidate_inode_buffers(inode);
 	clear_inode(inode);
 	fat_cache_inval_inode(inode);
+	fat_dindex_drop(inode);
 	fat_detach_prfs(inode);
 }
 
@@ -802,10 +1234,15 @@ static void fat_put_super(struct super_block *sb)
 {
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
 
+	/* drops the references of the closed files still queued */
+	flush_delayed_work(&sbi->close_work);
+	fat_mirror_flush(sb, 1);
 	fat_set_state(sb, 0, 0);
 
 	iput(sbi->fsinfo_inode);
 	iput(sbi->fat_inode);
+	fat_ent_access_exit(sb);
+	fat_hash_free(sbi);
 
 	call_rcu(&sbi->rcu, delayed_free);
 }
@@ -820,6 +1257,7 @@ static struct inode *fat_alloc_inode(struct super_block *sb)
 		return NULL;
 
 	init_rwsem(&ei->truncate_lock);
+	mutex_init(&ei->i_da_mutex);
 	/* Zeroing to allow iput() even if partial initialized inode. */
 	ei->mmu_private = 0;
 	ei->i_start = 0;
@@ -828,6 +1266,11 @@ static struct inode *fat_alloc_inode(struct super_block *sb)
 	ei->i_pos = 0;
 	ei->i_crtime.tv_sec = 0;
 	ei->i_crtime.tv_nsec = 0;
+	ei->i_backup = 0;
+	ei->i_backup_time = 0;
+	ei->i_reserved = 0;
+	ei->i_fsync_nr = 0;
+	ei->i_fsync_all = false;
 
 	return &ei->vfs_inode;
 }
@@ -843,10 +1286,20 @@ static void init_once(void *foo)
 
 	spin_lock_init(&ei->cache_lru_lock);
 	ei->nr_caches = 0;
+	ei->cache_full = 0;
 	ei->cache_valid_id = FAT_CACHE_VALID + 1;
 	INIT_LIST_HEAD(&ei->cache_lru);
-	INIT_HLIST_NODE(&ei->i_fat_hash);
+	ei->cache_tree = RB_ROOT;
+	INIT_LIST_HEAD(&ei->cache_inodes);
+	INIT_HLIST_BL_NODE(&ei->i_fat_hash);
 	INIT_HLIST_NODE(&ei->i_dir_hash);
+	INIT_LIST_HEAD(&ei->i_close);
+	ei->i_close_again = 0;
+	mutex_init(&ei->i_dir_lock);
+	seqcount_init(&ei->i_dir_seq);
+	ei->i_dir_writers = 0;
+	spin_lock_init(&ei->i_dindex_lock);
+	ei->i_dindex = NULL;
 	inode_init_once(&ei->vfs_inode);
 }
 
@@ -897,18 +1350,25 @@ static int fat_statfs(struct dentry *dentry, struct kstatfs *buf)
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
 	u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
 
+	unsigned int free;
+
 	/* If the count of free cluster is still unknown, counts it here. */
-	if (sbi->free_clusters == -1 || !sbi->free_clus_valid) {
+	if (!fat_free_valid(sbi) && !fat_counting(sbi)) {
 		int err = fat_count_free_clusters(dentry->d_sb);
 		if (err)
 			return err;
 	}
+	/* Being counted: the FSINFO value, or what was counted so far */
+	free = sbi->free_clusters;
+	if (free == -1)
+		free = sbi->scan_free;
 
 	buf->f_type = dentry->d_sb->s_magic;
 	buf->f_bsize = sbi->cluster_size;
 	buf->f_blocks = sbi->max_cluster - FAT_START_ENT;
-	buf->f_bfree = sbi->free_clusters;
-	buf->f_bavail = sbi->free_clusters;
+	/* Clusters reserved by delayed allocation are as good as used */
+	buf->f_bfree = free - min(free, sbi->reserved_clusters);
+	buf->f_bavail = buf->f_bfree;
 	buf->f_fsid = u64_to_fsid(id);
 	buf->f_namelen =
 		(sbi->options.isvfat ? FAT_LFN_LEN : 12) * NLS_MAX_CHARSET_SIZE;
@@ -922,6 +1382,7 @@ static int __fat_write_inode(struct inode *inode, int wait)
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
 	struct buffer_head *bh;
 	struct msdos_dir_entry *raw_entry;
+	struct hlist_bl_head *head;
 	loff_t i_pos;
 	sector_t blocknr;
 	int err, offset;
@@ -941,9 +1402,10 @@ retry:
 		       "for updating (i_pos %lld)", i_pos);
 		return -EIO;
 	}
-	spin_lock(&sbi->inode_hash_lock);
-	if (i_pos != MSDOS_I(inode)->i_pos) {
-		spin_unlock(&sbi->inode_hash_lock);
+	head = fat_hash(sbi, i_pos);
+	hlist_bl_lock(head);
+	if (i_pos != fat_i_pos_read(sbi, inode)) {
+		hlist_bl_unlock(head);
 		brelse(bh);
 		goto retry;
 	}
@@ -957,14 +1419,24 @@ retry:
 	fat_set_start(raw_entry, MSDOS_I(inode)->i_logstart);
 	fat_time_unix2fat_prfs(sbi, &inode->i_mtime, &raw_entry->time,
 			  &raw_entry->date, NULL);
-	if (sbi->options.isvfat) {
+	if (MSDOS_I(inode)->i_backup)
+		raw_entry->lcase |= FAT_PRFS_BACKUP;
+	if (sbi->options.isvfat && MSDOS_I(inode)->i_backup) {
+		struct timespec64 ts;
+
+		ts = ns_to_timespec64(MSDOS_I(inode)->i_backup_time);
+		fat_time_unix2fat_prfs(sbi, &ts, &raw_entry->ctime,
+				  &raw_entry->cdate, &raw_entry->ctime_cs);
+		raw_entry->adate = cpu_to_le16((ts.tv_nsec % (10 * NSEC_PER_MSEC))
+					       / NSEC_PER_USEC);
+	} else if (sbi->options.isvfat) {
 		__le16 atime;
 		fat_time_unix2fat_prfs(sbi, &inode->i_atime, &atime,
 				  &raw_entry->adate, NULL);
 		fat_time_unix2fat_prfs(sbi, &MSDOS_I(inode)->i_crtime, &raw_entry->ctime,
 				  &raw_entry->cdate, &raw_entry->ctime_cs);
 	}
-	spin_unlock(&sbi->inode_hash_lock);
+	hlist_bl_unlock(head);
 	mark_buffer_dirty(bh);
 	err = 0;
 	if (wait)
@@ -980,15 +1452,23 @@ static int fat_write_inode(struct inode *inode, struct writeback_control *wbc)
 	if (inode->i_ino == MSDOS_FSINFO_INO) {
 		struct super_block *sb = inode->i_sb;
 
-		mutex_lock(&MSDOS_SB(sb)->s_lock);
+		err = fat_mirror_flush(sb, wbc->sync_mode == WB_SYNC_ALL);
+		if (err)
+			return err;
 		err = fat_clusters_flush(sb);
-		mutex_unlock(&MSDOS_SB(sb)->s_lock);
 	} else
 		err = __fat_write_inode(inode, wbc->sync_mode == WB_SYNC_ALL);
 
 	return err;
 }
 
+static int fat_sync_fs(struct super_block *sb, int wait)
+{
+	/* also drops the references of closed files before unmount */
+	flush_delayed_work(&MSDOS_SB(sb)->close_work);
+	return fat_mirror_flush(sb, wait);
+}
+
 int fat_sync_inode_prfs(struct inode *inode)
 {
 	printk(KERN_INFO "fat_sync_inode_prfs function...\n");
@@ -999,12 +1479,14 @@ int fat_sync_inode_prfs(struct inode *inode)
 EXPORT_SYMBOL_GPL(fat_sync_inode_prfs);
 
 static int fat_show_options(struct seq_file *m, struct dentry *root);
+static void fat_close_work(struct work_struct *work);
 static const struct super_operations fat_sops = {
 	.alloc_inode	= fat_alloc_inode,
 	.free_inode	= fat_free_inode,
 	.write_inode	= fat_write_inode,
 	.evict_inode	= fat_evict_inode,
 	.put_super	= fat_put_super,
+	.sync_fs	= fat_sync_fs,
 	.statfs		= fat_statfs,
 	.remount_fs	= fat_remount,
 
@@ -1097,6 +1579,16 @@ static int fat_show_options(struct seq_file *m, struct dentry *root)
 		seq_puts(m, ",nfs=stale_rw");
 	if (opts->discard)
 		seq_puts(m, ",discard");
+	if (opts->delalloc)
+		seq_puts(m, ",delalloc");
+	if (opts->mapahead)
+		seq_puts(m, ",mapahead");
+	if (opts->iomap)
+		seq_puts(m, ",iomap");
+	if (opts->oldbackups)
+		seq_puts(m, ",oldbackups");
+	if (opts->trustfsinfo)
+		seq_puts(m, ",trustfsinfo");
 	if (opts->dos1xfloppy)
 		seq_puts(m, ",dos1xfloppy");
 
@@ -1114,6 +1606,7 @@ enum {
 	Opt_obsolete, Opt_flush, Opt_tz_utc, Opt_rodir, Opt_err_cont,
 	Opt_err_panic, Opt_err_ro, Opt_discard, Opt_nfs, Opt_time_offset,
 	Opt_nfs_stale_rw, Opt_nfs_nostale_ro, Opt_err, Opt_dos1xfloppy,
+	Opt_delalloc, Opt_mapahead, Opt_trustfsinfo, Opt_iomap, Opt_oldbackups,
 };
 
 static const match_table_t fat_tokens = {
@@ -1147,6 +1640,11 @@ static const match_table_t fat_tokens = {
 	{Opt_nfs_stale_rw, "nfs=stale_rw"},
 	{Opt_nfs_nostale_ro, "nfs=nostale_ro"},
 	{Opt_dos1xfloppy, "dos1xfloppy"},
+	{Opt_delalloc, "delalloc"},
+	{Opt_mapahead, "mapahead"},
+	{Opt_iomap, "iomap"},
+	{Opt_oldbackups, "oldbackups"},
+	{Opt_trustfsinfo, "trustfsinfo"},
 	{Opt_obsolete, "conv=binary"},
 	{Opt_obsolete, "conv=text"},
 	{Opt_obsolete, "conv=auto"},
@@ -1417,6 +1915,21 @@ static int parse_options(struct super_block *sb, char *options, int is_vfat,
 		case Opt_discard:
 			opts->discard = 1;
 			break;
+		case Opt_delalloc:
+			opts->delalloc = 1;
+			break;
+		case Opt_mapahead:
+			opts->mapahead = 1;
+			break;
+		case Opt_trustfsinfo:
+			opts->trustfsinfo = 1;
+			break;
+		case Opt_iomap:
+			opts->iomap = 1;
+			break;
+		case Opt_oldbackups:
+			opts->oldbackups = 1;
+			break;
 
 		/* obsolete mount options */
 		case Opt_obsolete:
@@ -1447,6 +1960,12 @@ out:
 		opts->allow_utime = ~opts->fs_dmask & (S_IWGRP | S_IWOTH);
 	if (opts->unicode_xlate)
 		opts->utf8 = 0;
+	/* iomap allocates the clusters at write time */
+	if (opts->iomap && opts->delalloc) {
+		fat_msg(sb, KERN_WARNING,
+			"\"delalloc\" is ignored with \"iomap\"");
+		opts->delalloc = 0;
+	}
 	if (opts->nfs == FAT_NFS_NOSTALE_RO) {
 		sb->s_flags |= SB_RDONLY;
 		sb->s_export_op = &fat_export_ops_nostale;
@@ -1710,6 +2229,16 @@ int fat_fill_super_prfs(struct super_block *sb, void *data, int silent, int isvf
 	 */
 	sb->s_time_gran = 1;
 	mutex_init(&sbi->nfs_build_inode_lock);
+	mutex_init(&sbi->flush_lock);
+	atomic64_set(&sbi->flush_seq, 0);
+	spin_lock_init(&sbi->close_lock);
+	INIT_LIST_HEAD(&sbi->close_list);
+	INIT_DELAYED_WORK(&sbi->close_work, fat_close_work);
+	spin_lock_init(&sbi->discard_lock);
+	sbi->discard_tree = RB_ROOT;
+	init_waitqueue_head(&sbi->discard_wait);
+	INIT_DELAYED_WORK(&sbi->discard_work, fat_discard_work);
+	sbi->sb = sb;
 	ratelimit_state_init(&sbi->ratelimit, DEFAULT_RATELIMIT_INTERVAL,
 			     DEFAULT_RATELIMIT_BURST);
 
@@ -1769,7 +2298,6 @@ int fat_fill_super_prfs(struct super_block *sb, void *data, int silent, int isvf
 		brelse(bh_resize);
 	}
 
-	mutex_init(&sbi->s_lock);
 	sbi->cluster_size = sb->s_blocksize * sbi->sec_per_clus;
 	sbi->cluster_bits = ffs(sbi->cluster_size) - 1;
 	sbi->fats = bpb.fat_fats;
@@ -1876,14 +2404,19 @@ int fat_fill_super_prfs(struct super_block *sb, void *data, int silent, int isvf
 	/* check the free_clusters, it's not necessarily correct */
 	if (sbi->free_clusters != -1 && sbi->free_clusters > total_clusters)
 		sbi->free_clusters = -1;
+	/* FSINFO was kept up to date if the volume was cleanly unmounted */
+	if (sbi->options.trustfsinfo && !sbi->dirty &&
+	    sbi->free_clusters != -1)
+		sbi->free_clus_valid = 1;
 	/* check the prev_free, it's not necessarily correct */
 	sbi->prev_free %= sbi->max_cluster;
 	if (sbi->prev_free < FAT_START_ENT)
 		sbi->prev_free = FAT_START_ENT;
 
 	/* set up enough so that it can read an inode */
-	fat_hash_init(sb);
-	dir_hash_init(sb);
+	error = fat_hash_init(sb);
+	if (error)
+		goto out_fail;
 	fat_ent_access_init(sb);
 
 	/*
@@ -1953,6 +2486,8 @@ int fat_fill_super_prfs(struct super_block *sb, void *data, int silent, int isvf
 			"mounting with \"discard\" option, but the device does not support discard");
 
 	fat_set_state(sb, 1, 0);
+	if (!sb_rdonly(sb))
+		fat_count_start(sb);
 	return 0;
 
 out_invalid:
@@ -1963,6 +2498,8 @@ out_invalid:
 out_fail:
 	iput(fsinfo_inode);
 	iput(fat_inode);
+	fat_ent_access_exit(sb);
+	fat_hash_free(sbi);
 	unload_nls(sbi->nls_io);
 	unload_nls(sbi->nls_disk);
 	fat_reset_iocharset(&sbi->options);
@@ -2020,6 +2557,76 @@ int fat_flush_inodes_prfs(struct super_block *sb, struct inode *i1, struct inode
 }
 EXPORT_SYMBOL_GPL(fat_flush_inodes_prfs);
 
+/*
+ * With "flush", the files closed within FAT_CLOSE_DELAY are written back
+ * together by a work item, rather than each close sleeping on its I/O.
+ * The work waits for the I/O to complete, so that fat_sync_fs() and
+ * unmount, which flush it, know the files are on disk. A queued inode
+ * is pinned until then; closed again meanwhile, it takes another pass.
+ */
+static void fat_close_work(struct work_struct *work)
+{
+	struct msdos_sb_info *sbi = container_of(to_delayed_work(work),
+						 struct msdos_sb_info,
+						 close_work);
+	struct msdos_inode_info *ei, *n;
+	struct super_block *sb = NULL;
+	struct inode *done;
+	bool again = false;
+	LIST_HEAD(list);
+
+	spin_lock(&sbi->close_lock);
+	list_splice_init(&sbi->close_list, &list);
+	list_for_each_entry(ei, &list, i_close)
+		ei->i_close_again = 0;
+	spin_unlock(&sbi->close_lock);
+
+	list_for_each_entry(ei, &list, i_close) {
+		sb = ei->vfs_inode.i_sb;
+		writeback_inode(&ei->vfs_inode);
+	}
+	list_for_each_entry(ei, &list, i_close)
+		filemap_fdatawait(ei->vfs_inode.i_mapping);
+	if (sb)
+		sync_blockdev(sb->s_bdev);
+
+	list_for_each_entry_safe(ei, n, &list, i_close) {
+		done = NULL;
+		spin_lock(&sbi->close_lock);
+		if (ei->i_close_again) {
+			list_move_tail(&ei->i_close, &sbi->close_list);
+			again = true;
+		} else {
+			list_del_init(&ei->i_close);
+			done = &ei->vfs_inode;
+		}
+		spin_unlock(&sbi->close_lock);
+		iput(done);
+	}
+	if (again)
+		queue_delayed_work(system_wq, &sbi->close_work,
+				   FAT_CLOSE_DELAY);
+}
+
+/* Queue @inode, just closed for writing, for fat_close_work() */
+void fat_flush_on_close(struct inode *inode)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(inode->i_sb);
+	struct msdos_inode_info *ei = MSDOS_I(inode);
+
+	spin_lock(&sbi->close_lock);
+	if (list_empty(&ei->i_close)) {
+		ihold(inode);
+		list_add_tail(&ei->i_close, &sbi->close_list);
+	} else {
+		/* being written back by fat_close_work(), maybe too early */
+		ei->i_close_again = 1;
+	}
+	spin_unlock(&sbi->close_lock);
+	/* the first close of a batch arms the timer */
+	queue_delayed_work(system_wq, &sbi->close_work, FAT_CLOSE_DELAY);
+}
+
 static int __init init_fat_fs(void)
 {
 	int err;
@@ -2030,12 +2637,18 @@ static int __init init_fat_fs(void)
 	if (err)
 		return err;
 
-	err = fat_init_inodecache();
+	err = fat_dindex_init();
 	if (err)
 		goto failed;
 
+	err = fat_init_inodecache();
+	if (err)
+		goto failed_dindex;
+
 	return 0;
 
+failed_dindex:
+	fat_dindex_destroy();
 failed:
 	fat_cache_destroy();
 	return err;
@@ -2044,6 +2657,7 @@ failed:
 static void __exit exit_fat_fs(void)
 {
 	fat_cache_destroy();
+	fat_dindex_destroy();
 	fat_destroy_inodecache();
 
 	printk(KERN_INFO "FAT32PRFS exited\n");
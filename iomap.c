@@ -0,0 +1,460 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ *  linux/fs/fat/iomap.c
+ *
+ *  iomap based I/O of regular files, for the "iomap" mount option
+ */
+
+#include <linux/iomap.h>
+#include <linux/pagemap.h>
+#include <linux/backing-dev.h>
+#include <linux/uio.h>
+#include <linux/mm.h>
+#include "fat_prfs.h"
+
+/*
+ * With the "iomap" option, regular files do their I/O through iomap
+ * instead of buffer_heads: one mapping covers a whole run of contiguous
+ * clusters taken from the cluster cache, the page cache may use large
+ * folios. Direct I/O goes through iomap_dio_rw() with or without it.
+ *
+ * Clusters are allocated at write time, all those a write needs in one
+ * chain. FAT has no holes, so a write past the end of the file zeroes
+ * the gap first, and ->mmu_private still tells how far the file is
+ * initialized.
+ */
+
+/* Append the clusters up to file cluster @last. Caller holds ->i_rwsem. */
+static int fat_iomap_alloc(struct inode *inode, int nr_alloc, int last)
+{
+	int nr_cluster = last - nr_alloc + 1;
+	int err;
+
+	err = fat_add_clusters(inode, nr_cluster);
+	/* Short of space for all of them, go on one cluster at a time */
+	if (err == -ENOSPC && nr_cluster > 1)
+		err = fat_add_clusters(inode, 1);
+	return err;
+}
+
+static int fat_iomap_begin(struct inode *inode, loff_t offset, loff_t length,
+			   unsigned int flags, struct iomap *iomap,
+			   struct iomap *srcmap)
+{
+	struct super_block *sb = inode->i_sb;
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	const unsigned int cluster_bits = sbi->cluster_bits;
+	int cluster = offset >> cluster_bits;
+	int last, nr_alloc, dclus, len, err;
+	u16 new = 0;
+
+	last = min_t(loff_t, (offset + length - 1) >> cluster_bits, INT_MAX);
+	nr_alloc = inode->i_blocks >> (cluster_bits - 9);
+	if (cluster >= nr_alloc && (flags & (IOMAP_WRITE | IOMAP_ZERO))) {
+		if (flags & IOMAP_NOWAIT)
+			return -EAGAIN;
+		err = fat_iomap_alloc(inode, nr_alloc, last);
+		if (err)
+			return err;
+		nr_alloc = inode->i_blocks >> (cluster_bits - 9);
+		new = IOMAP_F_NEW;
+	}
+
+	iomap->bdev = sb->s_bdev;
+	iomap->offset = (loff_t)cluster << cluster_bits;
+	iomap->flags = new;
+	if (cluster >= nr_alloc) {
+		/* Past the chain, reads as zeroes */
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->length = ((loff_t)last + 1 - cluster) << cluster_bits;
+		return 0;
+	}
+
+	last = min(last, nr_alloc - 1);
+	if (flags & IOMAP_NOWAIT)
+		err = fat_get_extent_cached(inode, cluster, last - cluster + 1,
+					    &dclus, &len);
+	else
+		err = fat_get_extent(inode, cluster, last - cluster + 1,
+				     &dclus, &len);
+	if (err)
+		return err;
+	iomap->type = IOMAP_MAPPED;
+	iomap->addr = (u64)fat_clus_to_blknr(sbi, dclus) << sb->s_blocksize_bits;
+	iomap->length = (loff_t)len << cluster_bits;
+	return 0;
+}
+
+static int fat_iomap_end(struct inode *inode, loff_t offset, loff_t length,
+			 ssize_t written, unsigned int flags,
+			 struct iomap *iomap)
+{
+	struct msdos_inode_info *ei = MSDOS_I(inode);
+
+	/* Buffered writes and zeroing run under ->i_rwsem */
+	if (!(flags & (IOMAP_WRITE | IOMAP_ZERO)) ||
+	    (flags & (IOMAP_DIRECT | IOMAP_FAULT)))
+		return 0;
+	if (written > 0 && offset + written > ei->mmu_private)
+		ei->mmu_private = offset + written;
+	return 0;
+}
+
+const struct iomap_ops fat_iomap_ops = {
+	.iomap_begin	= fat_iomap_begin,
+	.iomap_end	= fat_iomap_end,
+};
+
+/*
+ * Writeback maps through the cluster cache too. A mapping is reused for
+ * the following folios until a truncate invalidates the cache.
+ */
+struct fat_writepage_ctx {
+	struct iomap_writepage_ctx ctx;
+	unsigned int cache_id;
+};
+
+static int fat_map_blocks(struct iomap_writepage_ctx *wpc,
+			  struct inode *inode, loff_t offset)
+{
+	struct fat_writepage_ctx *fwpc =
+		container_of(wpc, struct fat_writepage_ctx, ctx);
+	unsigned int id = READ_ONCE(MSDOS_I(inode)->cache_valid_id);
+
+	if (offset >= wpc->iomap.offset &&
+	    offset < wpc->iomap.offset + wpc->iomap.length &&
+	    id == fwpc->cache_id)
+		return 0;
+
+	fwpc->cache_id = id;
+	return fat_iomap_begin(inode, offset,
+			       max_t(loff_t, i_size_read(inode) - offset, 1), 0,
+			       &wpc->iomap, NULL);
+}
+
+static const struct iomap_writeback_ops fat_writeback_ops = {
+	.map_blocks	= fat_map_blocks,
+};
+
+static int fat_iomap_writepages(struct address_space *mapping,
+				struct writeback_control *wbc)
+{
+	struct fat_writepage_ctx wpc = { };
+
+	return iomap_writepages(mapping, wbc, &wpc.ctx, &fat_writeback_ops);
+}
+
+static int fat_iomap_read_folio(struct file *file, struct folio *folio)
+{
+	return iomap_read_folio(folio, &fat_iomap_ops);
+}
+
+static void fat_iomap_readahead(struct readahead_control *rac)
+{
+	iomap_readahead(rac, &fat_iomap_ops);
+}
+
+static sector_t fat_iomap_bmap(struct address_space *mapping, sector_t block)
+{
+	struct inode *inode = mapping->host;
+	sector_t blocknr;
+
+	/* fat_get_cluster() assumes the requested blocknr isn't truncated. */
+	down_read(&MSDOS_I(inode)->truncate_lock);
+	blocknr = iomap_bmap(mapping, block, &fat_iomap_ops);
+	up_read(&MSDOS_I(inode)->truncate_lock);
+
+	return blocknr;
+}
+
+const struct address_space_operations fat_iomap_aops = {
+	.read_folio	= fat_iomap_read_folio,
+	.readahead	= fat_iomap_readahead,
+	.writepages	= fat_iomap_writepages,
+	.dirty_folio	= filemap_dirty_folio,
+	.release_folio	= iomap_release_folio,
+	.invalidate_folio = iomap_invalidate_folio,
+	.bmap		= fat_iomap_bmap,
+	.direct_IO	= noop_direct_IO,
+	.migrate_folio	= filemap_migrate_folio,
+	.is_partially_uptodate = iomap_is_partially_uptodate,
+	.error_remove_page = generic_error_remove_page,
+};
+
+/*
+ * Zero the file from its size up to @pos, allocating the clusters on the
+ * way. The size follows. Caller holds ->i_rwsem.
+ */
+int fat_iomap_expand(struct inode *inode, loff_t pos)
+{
+	loff_t size = i_size_read(inode);
+
+	if (pos <= size)
+		return 0;
+	return iomap_zero_range(inode, size, pos - size, NULL, &fat_iomap_ops);
+}
+
+int fat_iomap_truncate_page(struct inode *inode, loff_t from)
+{
+	return iomap_truncate_page(inode, from, NULL, &fat_iomap_ops);
+}
+
+static ssize_t fat_iomap_buffered_write(struct kiocb *iocb,
+					struct iov_iter *from)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	loff_t end = iocb->ki_pos + iov_iter_count(from);
+	ssize_t ret;
+
+	ret = fat_iomap_expand(inode, iocb->ki_pos);
+	if (!ret) {
+		current->backing_dev_info = inode_to_bdi(inode);
+		ret = iomap_file_buffered_write(iocb, from, &fat_iomap_ops);
+		current->backing_dev_info = NULL;
+		if (ret > 0)
+			iocb->ki_pos += ret;
+	}
+
+	/* Drop what was allocated for the part not written */
+	if (iocb->ki_pos < end && end > inode->i_size) {
+		truncate_pagecache(inode, inode->i_size);
+		fat_truncate_blocks(inode, inode->i_size);
+	}
+	if (ret > 0) {
+		MSDOS_I(inode)->i_attrs |= ATTR_ARCH;
+		mark_inode_dirty(inode);
+	}
+	return ret;
+}
+
+ssize_t fat_iomap_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	ssize_t ret;
+
+	inode_lock(inode);
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out;
+	ret = file_modified(file);
+	if (ret)
+		goto out;
+	ret = fat_iomap_buffered_write(iocb, from);
+out:
+	inode_unlock(inode);
+	if (ret > 0)
+		ret = generic_write_sync(iocb, ret);
+	return ret;
+}
+
+/*
+ * Direct I/O, with or without the "iomap" option. It may complete
+ * asynchronously, which io_uring relies on for deep queues. Truncate
+ * waits for it in inode_dio_wait().
+ */
+ssize_t fat_dio_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret;
+
+	if (!iov_iter_count(to))
+		return 0;
+
+	/* Keep truncate away from the chain */
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock_shared(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock_shared(inode);
+	}
+	ret = iomap_dio_rw(iocb, to, &fat_iomap_ops, NULL, 0, NULL, 0);
+	inode_unlock_shared(inode);
+	file_accessed(iocb->ki_filp);
+	return ret;
+}
+
+/* Zero the file from its size up to @pos. Caller holds ->i_rwsem. */
+static int fat_dio_zero_to(struct inode *inode, loff_t pos)
+{
+	if (MSDOS_SB(inode->i_sb)->options.iomap)
+		return fat_iomap_expand(inode, pos);
+	if (pos <= i_size_read(inode))
+		return 0;
+	return generic_cont_expand_simple(inode, pos);
+}
+
+/*
+ * An extending write is waited for under ->i_rwsem. Raise the size before
+ * iomap_dio_complete() syncs an O_SYNC/O_DSYNC write, so that it is
+ * written with the entry.
+ */
+static int fat_dio_write_end_io(struct kiocb *iocb, ssize_t size, int error,
+				unsigned int flags)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct msdos_inode_info *ei = MSDOS_I(inode);
+	loff_t end = iocb->ki_pos + size;
+
+	if (error || size <= 0)
+		return error;
+	if (end > i_size_read(inode)) {
+		i_size_write(inode, end);
+		if (ei->mmu_private < end)
+			ei->mmu_private = end;
+	}
+	ei->i_attrs |= ATTR_ARCH;
+	mark_inode_dirty(inode);
+	return 0;
+}
+
+static const struct iomap_dio_ops fat_dio_write_ops = {
+	.end_io		= fat_dio_write_end_io,
+};
+
+/*
+ * What direct I/O couldn't write goes through the page cache, and is
+ * then written back and dropped from it as O_DIRECT expects.
+ */
+static ssize_t fat_dio_write_buffered(struct kiocb *iocb,
+				      struct iov_iter *from)
+{
+	struct address_space *mapping = iocb->ki_filp->f_mapping;
+	struct inode *inode = mapping->host;
+	loff_t pos = iocb->ki_pos, endbyte;
+	ssize_t status;
+	int err;
+
+	if (MSDOS_SB(inode->i_sb)->options.iomap) {
+		status = fat_iomap_buffered_write(iocb, from);
+	} else {
+		current->backing_dev_info = inode_to_bdi(inode);
+		status = generic_perform_write(iocb, from);
+		current->backing_dev_info = NULL;
+		if (status > 0)
+			iocb->ki_pos += status;
+	}
+	if (status <= 0)
+		return status;
+
+	endbyte = pos + status - 1;
+	err = filemap_write_and_wait_range(mapping, pos, endbyte);
+	if (err)
+		return err;
+	invalidate_mapping_pages(mapping, pos >> PAGE_SHIFT,
+				 endbyte >> PAGE_SHIFT);
+	return status;
+}
+
+/*
+ * A write inside the file is submitted and left to complete on its own.
+ * A write extending the file first zeroes the gap up to it through the
+ * page cache, gets its clusters allocated by fat_iomap_begin() and is
+ * waited for, so that the size is only raised over written data. It
+ * must be block aligned, as nothing would zero the rest of its blocks;
+ * an unaligned one goes through the page cache.
+ */
+ssize_t fat_dio_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct file *file = iocb->ki_filp;
+	struct inode *inode = file_inode(file);
+	struct msdos_inode_info *ei = MSDOS_I(inode);
+	const loff_t blockmask = inode->i_sb->s_blocksize - 1;
+	const struct iomap_dio_ops *dops = NULL;
+	unsigned int dio_flags = 0;
+	ssize_t ret, status = 0;
+	loff_t end;
+	bool extend;
+
+	if (iocb->ki_flags & IOCB_NOWAIT) {
+		if (!inode_trylock(inode))
+			return -EAGAIN;
+	} else {
+		inode_lock(inode);
+	}
+	ret = generic_write_checks(iocb, from);
+	if (ret <= 0)
+		goto out;
+	ret = kiocb_modified(iocb);
+	if (ret)
+		goto out;
+
+	end = iocb->ki_pos + iov_iter_count(from);
+	extend = end > i_size_read(inode);
+	if ((ei->i_reserved || extend) && (iocb->ki_flags & IOCB_NOWAIT)) {
+		ret = -EAGAIN;
+		goto out;
+	}
+	/* The delayed clusters come first in the chain */
+	ret = fat_alloc_delayed(inode);
+	if (ret)
+		goto out;
+
+	if (extend) {
+		if ((iocb->ki_pos | end) & blockmask) {
+			ret = 0;
+			goto buffered;
+		}
+		ret = fat_dio_zero_to(inode, iocb->ki_pos);
+		if (ret)
+			goto out;
+		dio_flags |= IOMAP_DIO_FORCE_WAIT;
+		dops = &fat_dio_write_ops;
+	}
+
+	/* Syncs an O_SYNC/O_DSYNC write itself */
+	ret = iomap_dio_rw(iocb, from, &fat_iomap_ops, dops, dio_flags,
+			   NULL, 0);
+	/* The page cache couldn't be invalidated */
+	if (ret == -ENOTBLK)
+		ret = 0;
+	/* Drop the clusters allocated for the part not written */
+	if (extend && (ret < 0 || iov_iter_count(from)))
+		fat_truncate_blocks(inode, i_size_read(inode));
+	if (ret < 0 || !iov_iter_count(from))
+		goto out;
+
+buffered:
+	status = fat_dio_write_buffered(iocb, from);
+	if (status > 0)
+		ret += status;
+	else if (!ret)
+		ret = status;
+out:
+	inode_unlock(inode);
+	/* Only the part written through the page cache is left to sync */
+	if (status > 0) {
+		status = generic_write_sync(iocb, status);
+		if (status < 0)
+			ret = status;
+	}
+	return ret;
+}
+
+static vm_fault_t fat_iomap_page_mkwrite(struct vm_fault *vmf)
+{
+	struct inode *inode = file_inode(vmf->vma->vm_file);
+	vm_fault_t ret;
+
+	sb_start_pagefault(inode->i_sb);
+	file_update_time(vmf->vma->vm_file);
+	down_read(&MSDOS_I(inode)->truncate_lock);
+	ret = iomap_page_mkwrite(vmf, &fat_iomap_ops);
+	up_read(&MSDOS_I(inode)->truncate_lock);
+	sb_end_pagefault(inode->i_sb);
+	return ret;
+}
+
+static const struct vm_operations_struct fat_iomap_vm_ops = {
+	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
+	.page_mkwrite	= fat_iomap_page_mkwrite,
+};
+
+int fat_iomap_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	file_accessed(file);
+	vma->vm_ops = &fat_iomap_vm_ops;
+	return 0;
+}
@@ -9,6 +9,7 @@
 
 #include "fat_prfs.h"
 #include <linux/iversion.h>
+#include <linux/blkdev.h>
 
 /*
  * fat_fs_error reports a file system problem that might indicate fa data
@@ -72,6 +73,7 @@ int fat_clusters_flush(struct super_block *sb)
 	struct msdos_sb_info *sbi = MSDOS_SB(sb);
 	struct buffer_head *bh;
 	struct fat_boot_fsinfo *fsinfo;
+	unsigned int free_clusters, prev_free;
 
 	if (!is_fat32(sbi))
 		return 0;
@@ -91,10 +93,15 @@ int fat_clusters_flush(struct super_block *sb)
 		       le32_to_cpu(fsinfo->signature2),
 		       sbi->fsinfo_sector);
 	} else {
-		if (sbi->free_clusters != -1)
-			fsinfo->free_clusters = cpu_to_le32(sbi->free_clusters);
-		if (sbi->prev_free != -1)
-			fsinfo->next_cluster = cpu_to_le32(sbi->prev_free);
+		/* Only an exact count, which "trustfsinfo" can rely on */
+		spin_lock(&sbi->free_lock);
+		free_clusters = fat_free_valid(sbi) ? sbi->free_clusters : -1;
+		prev_free = sbi->prev_free;
+		spin_unlock(&sbi->free_lock);
+
+		fsinfo->free_clusters = cpu_to_le32(free_clusters);
+		if (prev_free != -1)
+			fsinfo->next_cluster = cpu_to_le32(prev_free);
 		mark_buffer_dirty(bh);
 	}
 	brelse(bh);
@@ -385,3 +392,33 @@ int fat_sync_bhs(struct buffer_head **bhs, int nr_bhs)
 	}
 	return err;
 }
+
+/*
+ * Flush the disk write cache for fsync. An fsync arriving while a flush
+ * runs waits for it and then for the next one, which any fsyncs queued
+ * meanwhile share: a flush started after their writes completed covers
+ * them all.
+ */
+int fat_flush_device(struct super_block *sb)
+{
+	struct msdos_sb_info *sbi = MSDOS_SB(sb);
+	u64 seq;
+	int err;
+
+	/* order the completed writes before reading the sequence */
+	smp_mb();
+	seq = atomic64_read(&sbi->flush_seq) + 1;
+
+	mutex_lock(&sbi->flush_lock);
+	if (sbi->flush_done >= seq) {
+		err = sbi->flush_err;
+		goto out;
+	}
+	seq = atomic64_inc_return(&sbi->flush_seq);
+	err = blkdev_issue_flush(sb->s_bdev);
+	sbi->flush_done = seq;
+	sbi->flush_err = err;
+out:
+	mutex_unlock(&sbi->flush_lock);
+	return err;
+}
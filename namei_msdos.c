@@ -209,7 +209,7 @@ static struct dentry *msdos_lookup(struct inode *dir, struct dentry *dentry,
 	struct inode *inode;
 	int err;
 
-	mutex_lock(&MSDOS_SB(sb)->s_lock);
+	fat_lock_dir(dir);
 	err = msdos_find(dir, dentry->d_name.name, dentry->d_name.len, &sinfo);
 	switch (err) {
 	case -ENOENT:
@@ -222,7 +222,7 @@ static struct dentry *msdos_lookup(struct inode *dir, struct dentry *dentry,
 	default:
 		inode = ERR_PTR(err);
 	}
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	fat_unlock_dir(dir);
 	return d_splice_alias(inode, dentry);
 }
 
@@ -274,7 +274,7 @@ static int msdos_create(struct user_namespace *mnt_userns, struct inode *dir,
 	unsigned char msdos_name[MSDOS_NAME];
 	int err, is_hid;
 
-	mutex_lock(&MSDOS_SB(sb)->s_lock);
+	fat_lock_dir(dir);
 
 	err = msdos_format_name(dentry->d_name.name, dentry->d_name.len,
 				msdos_name, &MSDOS_SB(sb)->options);
@@ -303,7 +303,7 @@ static int msdos_create(struct user_namespace *mnt_userns, struct inode *dir,
 
 	d_instantiate(dentry, inode);
 out:
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	fat_unlock_dir(dir);
 	if (!err)
 		err = fat_flush_inodes_prfs(sb, dir, inode);
 	return err;
@@ -317,7 +317,7 @@ static int msdos_rmdir(struct inode *dir, struct dentry *dentry)
 	struct fat_slot_info sinfo;
 	int err;
 
-	mutex_lock(&MSDOS_SB(sb)->s_lock);
+	fat_lock_dir(dir);
 	err = fat_dir_empty_prfs(inode);
 	if (err)
 		goto out;
@@ -334,7 +334,7 @@ static int msdos_rmdir(struct inode *dir, struct dentry *dentry)
 	fat_truncate_time_prfs(inode, NULL, S_CTIME);
 	fat_detach_prfs(inode);
 out:
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	fat_unlock_dir(dir);
 	if (!err)
 		err = fat_flush_inodes_prfs(sb, dir, inode);
 
@@ -352,7 +352,7 @@ static int msdos_mkdir(struct user_namespace *mnt_userns, struct inode *dir,
 	struct timespec64 ts;
 	int err, is_hid, cluster;
 
-	mutex_lock(&MSDOS_SB(sb)->s_lock);
+	fat_lock_dir(dir);
 
 	err = msdos_format_name(dentry->d_name.name, dentry->d_name.len,
 				msdos_name, &MSDOS_SB(sb)->options);
@@ -390,14 +390,14 @@ static int msdos_mkdir(struct user_namespace *mnt_userns, struct inode *dir,
 
 	d_instantiate(dentry, inode);
 
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	fat_unlock_dir(dir);
 	fat_flush_inodes_prfs(sb, dir, inode);
 	return 0;
 
 out_free:
 	fat_free_clusters_prfs(dir, cluster);
 out:
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	fat_unlock_dir(dir);
 	return err;
 }
 
@@ -409,7 +409,7 @@ static int msdos_unlink(struct inode *dir, struct dentry *dentry)
 	struct fat_slot_info sinfo;
 	int err;
 
-	mutex_lock(&MSDOS_SB(sb)->s_lock);
+	fat_lock_dir(dir);
 	err = msdos_find(dir, dentry->d_name.name, dentry->d_name.len, &sinfo);
 	if (err)
 		goto out;
@@ -421,7 +421,7 @@ static int msdos_unlink(struct inode *dir, struct dentry *dentry)
 	fat_truncate_time_prfs(inode, NULL, S_CTIME);
 	fat_detach_prfs(inode);
 out:
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	fat_unlock_dir(dir);
 	if (!err)
 		err = fat_flush_inodes_prfs(sb, dir, inode);
 
@@ -609,7 +609,7 @@ static int msdos_rename(struct user_namespace *mnt_userns,
 	if (flags & ~RENAME_NOREPLACE)
 		return -EINVAL;
 
-	mutex_lock(&MSDOS_SB(sb)->s_lock);
+	fat_lock_dirs(old_dir, new_dir);
 
 	err = msdos_format_name(old_dentry->d_name.name,
 				old_dentry->d_name.len, old_msdos_name,
@@ -628,7 +628,7 @@ static int msdos_rename(struct user_namespace *mnt_userns,
 	err = do_msdos_rename(old_dir, old_msdos_name, old_dentry,
 			      new_dir, new_msdos_name, new_dentry, is_hid);
 out:
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	fat_unlock_dirs(old_dir, new_dir);
 	if (!err)
 		err = fat_flush_inodes_prfs(sb, old_dir, new_dir);
 	return err;
@@ -321,6 +321,55 @@ static inline int to_shortname_char(struct nls_table *nls,
 	return len;
 }
 
+/*
+ * PRFS backups are named "_NNNNNNNNNNNNN_<name>" (see prfs_backup_prefix())
+ * and all share their first 6 characters for a day, so the numeric tails
+ * below collide and cost a probe each. Their alias is taken from the
+ * time stamp instead, as "_" and 7 base 36 digits, which only repeats
+ * after some 2.5 years of backups in the same directory.
+ */
+#define VFAT_BACKUP_PREFIX	15	/* "_NNNNNNNNNNNNN_" */
+#define VFAT_BACKUP_TRIES	16
+
+static bool vfat_backup_stamp(const wchar_t *uname, int ulen, u64 *stamp)
+{
+	int i;
+
+	if (ulen < VFAT_BACKUP_PREFIX || uname[0] != '_' ||
+	    uname[VFAT_BACKUP_PREFIX - 1] != '_')
+		return false;
+	*stamp = 0;
+	for (i = 1; i < VFAT_BACKUP_PREFIX - 1; i++) {
+		if (uname[i] < '0' || uname[i] > '9')
+			return false;
+		*stamp = *stamp * 10 + (uname[i] - '0');
+	}
+	return true;
+}
+
+/* Returns 0 with a unique alias as base of name_res, or -EEXIST */
+static int vfat_backup_shortname(struct inode *dir, u64 stamp,
+				 unsigned char *name_res)
+{
+	static const char digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	unsigned char alias[MSDOS_NAME];
+	u64 n;
+	int i, try;
+
+	memcpy(alias, name_res, MSDOS_NAME);
+	alias[0] = '_';
+	for (try = 0; try < VFAT_BACKUP_TRIES; try++, stamp++) {
+		n = stamp;
+		for (i = 7; i > 0; i--)
+			alias[i] = digits[do_div(n, 36)];
+		if (vfat_find_form(dir, alias) < 0) {
+			memcpy(name_res, alias, MSDOS_NAME);
+			return 0;
+		}
+	}
+	return -EEXIST;
+}
+
 /*
  * Given a valid longname, create a unique shortname.  Make sure the
  * shortname does not exist
@@ -339,6 +388,7 @@ static int vfat_create_shortname(struct inode *dir, struct nls_table *nls,
 	int sz = 0, extlen, baselen, i, numtail_baselen, numtail2_baselen;
 	int is_shortname;
 	struct shortname_info base_info, ext_info;
+	u64 stamp;
 
 	is_shortname = 1;
 	INIT_SHORTNAME_INFO(&base_info);
@@ -472,6 +522,10 @@ static int vfat_create_shortname(struct inode *dir, struct nls_table *nls,
 		if (vfat_find_form(dir, name_res) < 0)
 			return 0;
 
+	if (vfat_backup_stamp(uname, ulen, &stamp) &&
+	    !vfat_backup_shortname(dir, stamp, name_res))
+		return 0;
+
 	/*
 	 * Try to find a unique extension.  This used to
 	 * iterate through all possibilities sequentially,
@@ -701,6 +755,29 @@ static int vfat_find(struct inode *dir, const struct qstr *qname,
 	return fat_search_long_prfs(dir, qname->name, len, sinfo);
 }
 
+static int vfat_find_nolock(struct inode *dir, struct qstr *qname,
+			    struct fat_slot_info *sinfo)
+{
+	unsigned int len = vfat_striptail_len(qname);
+	if (len == 0)
+		return -ENOENT;
+	return fat_search_long_nolock(dir, qname->name, len, sinfo);
+}
+
+/*
+ * "oldbackups": versions without the backup flag recognised backups by
+ * their _NNNNNNNNNNNNN_ name. Flag those as they are looked up, backed
+ * up at their creation time.
+ */
+static void vfat_flag_old_backup(struct inode *inode, const struct qstr *name)
+{
+	if (!MSDOS_SB(inode->i_sb)->options.oldbackups ||
+	    !S_ISREG(inode->i_mode) || fat_is_backup(inode) ||
+	    !filename_backup(name->name))
+		return;
+	fat_set_backup(inode, &MSDOS_I(inode)->i_crtime);
+}
+
 static struct dentry *vfat_lookup(struct inode *dir, struct dentry *dentry,
 				  unsigned int flags)
 {
@@ -708,11 +785,19 @@ static struct dentry *vfat_lookup(struct inode *dir, struct dentry *dentry,
 	struct fat_slot_info sinfo;
 	struct inode *inode;
 	struct dentry *alias;
+	unsigned int seq;
+	bool locked = false;
 	int err;
 
-	mutex_lock(&MSDOS_SB(sb)->s_lock);
-
+	/* Try without the directory lock first, see fat_dir_read_begin() */
+	seq = fat_dir_read_begin(dir);
+	err = vfat_find_nolock(dir, &dentry->d_name, &sinfo);
+	goto found;
+relock:
+	fat_lock_dir(dir);
+	locked = true;
 	err = vfat_find(dir, &dentry->d_name, &sinfo);
+found:
 	if (err) {
 		if (err == -ENOENT) {
 			inode = NULL;
@@ -721,12 +806,21 @@ static struct dentry *vfat_lookup(struct inode *dir, struct dentry *dentry,
 		goto error;
 	}
 
-	inode = fat_build_inode_prfs(sb, sinfo.de, sinfo.i_pos);
+	if (locked)
+		inode = fat_build_inode_prfs(sb, sinfo.de, sinfo.i_pos);
+	else
+		inode = fat_build_inode_nolock(sb, sinfo.de, sinfo.i_pos,
+					       dir, seq);
 	brelse(sinfo.bh);
 	if (IS_ERR(inode)) {
 		err = PTR_ERR(inode);
 		goto error;
 	}
+	if (!locked && fat_dir_read_retry(dir, seq)) {
+		iput(inode);
+		goto relock;
+	}
+	vfat_flag_old_backup(inode, &dentry->d_name);
 
 	alias = d_find_alias(inode);
 	/*
@@ -744,18 +838,27 @@ static struct dentry *vfat_lookup(struct inode *dir, struct dentry *dentry,
 		if (!S_ISDIR(inode->i_mode))
 			d_move(alias, dentry);
 		iput(inode);
-		mutex_unlock(&MSDOS_SB(sb)->s_lock);
+		if (locked)
+			fat_unlock_dir(dir);
 		return alias;
 	} else
 		dput(alias);
 
 out:
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	if (!locked && fat_dir_read_retry(dir, seq)) {
+		iput(inode);
+		goto relock;
+	}
+	if (locked)
+		fat_unlock_dir(dir);
 	if (!inode)
 		vfat_d_version_set(dentry, inode_query_iversion(dir));
 	return d_splice_alias(inode, dentry);
 error:
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	if (!locked && err == -EAGAIN)
+		goto relock;
+	if (locked)
+		fat_unlock_dir(dir);
 	return ERR_PTR(err);
 }
 
@@ -770,7 +873,7 @@ static int vfat_create(struct user_namespace *mnt_userns, struct inode *dir,
 	
 	printk(KERN_INFO "vfat_create function: %s\n", dentry->d_iname);
 
-	mutex_lock(&MSDOS_SB(sb)->s_lock);
+	fat_lock_dir(dir);
 
 	ts = current_time(dir);
 	err = vfat_add_entry(dir, &dentry->d_name, 0, 0, &ts, &sinfo);
@@ -788,18 +891,17 @@ static int vfat_create(struct user_namespace *mnt_userns, struct inode *dir,
 
 	d_instantiate(dentry, inode);
 out:
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	fat_unlock_dir(dir);
 	return err;
 }
 
 static int vfat_rmdir(struct inode *dir, struct dentry *dentry)
 {
 	struct inode *inode = d_inode(dentry);
-	struct super_block *sb = dir->i_sb;
 	struct fat_slot_info sinfo;
 	int err;
 
-	mutex_lock(&MSDOS_SB(sb)->s_lock);
+	fat_lock_dir(dir);
 
 	err = fat_dir_empty_prfs(inode);
 	if (err)
@@ -818,7 +920,7 @@ static int vfat_rmdir(struct inode *dir, struct dentry *dentry)
 	fat_detach_prfs(inode);
 	vfat_d_version_set(dentry, inode_query_iversion(dir));
 out:
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	fat_unlock_dir(dir);
 
 	return err;
 }
@@ -826,15 +928,14 @@ out:
 static int vfat_unlink(struct inode *dir, struct dentry *dentry)
 {
 	struct inode *inode = d_inode(dentry);
-	struct super_block *sb = dir->i_sb;
 	struct fat_slot_info sinfo;
 	int err;
 
 	printk(KERN_INFO "vfat_unlink: %s.\n", dentry->d_name.name);
 	if (get_prfs_mode() !=2) return -1;
-	if (filename_backup(dentry->d_name.name) == 0) return -1;
+	if (!fat_is_backup(inode)) return -1;
 
-	mutex_lock(&MSDOS_SB(sb)->s_lock);
+	fat_lock_dir(dir);
 
 	err = vfat_find(dir, &dentry->d_name, &sinfo);
 	if (err)
@@ -848,7 +949,7 @@ static int vfat_unlink(struct inode *dir, struct dentry *dentry)
 	fat_detach_prfs(inode);
 	vfat_d_version_set(dentry, inode_query_iversion(dir));
 out:
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	fat_unlock_dir(dir);
 
 	return err;
 }
@@ -862,7 +963,7 @@ static int vfat_mkdir(struct user_namespace *mnt_userns, struct inode *dir,
 	struct timespec64 ts;
 	int err, cluster;
 
-	mutex_lock(&MSDOS_SB(sb)->s_lock);
+	fat_lock_dir(dir);
 
 	ts = current_time(dir);
 	cluster = fat_alloc_new_dir_prfs(dir, &ts);
@@ -888,13 +989,13 @@ static int vfat_mkdir(struct user_namespace *mnt_userns, struct inode *dir,
 
 	d_instantiate(dentry, inode);
 
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	fat_unlock_dir(dir);
 	return 0;
 
 out_free:
 	fat_free_clusters_prfs(dir, cluster);
 out:
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	fat_unlock_dir(dir);
 	return err;
 }
 
@@ -937,6 +1038,28 @@ static void vfat_update_dir_metadata(struct inode *dir, struct timespec64 *ts)
 		mark_inode_dirty(dir);
 }
 
+/*
+ * Rename moves inodes between entries with fat_detach_prfs() and
+ * fat_attach_prfs(). Both directories stay in a write section until it
+ * is done, so that a lookup without the lock (of the 8.3 alias, say)
+ * can't build a second inode from an entry in between.
+ */
+static void vfat_rename_begin(struct inode *old_dir, struct inode *new_dir)
+{
+	fat_lock_dirs(old_dir, new_dir);
+	fat_dir_write_begin(old_dir);
+	if (new_dir != old_dir)
+		fat_dir_write_begin(new_dir);
+}
+
+static void vfat_rename_end(struct inode *old_dir, struct inode *new_dir)
+{
+	if (new_dir != old_dir)
+		fat_dir_write_end(new_dir);
+	fat_dir_write_end(old_dir);
+	fat_unlock_dirs(old_dir, new_dir);
+}
+
 static int vfat_rename(struct inode *old_dir, struct dentry *old_dentry,
 		       struct inode *new_dir, struct dentry *new_dentry)
 {
@@ -947,12 +1070,11 @@ static int vfat_rename(struct inode *old_dir, struct dentry *old_dentry,
 	struct timespec64 ts;
 	loff_t new_i_pos;
 	int err, is_dir, corrupt = 0;
-	struct super_block *sb = old_dir->i_sb;
 
 	old_sinfo.bh = sinfo.bh = dotdot_bh = NULL;
 	old_inode = d_inode(old_dentry);
 	new_inode = d_inode(new_dentry);
-	mutex_lock(&MSDOS_SB(sb)->s_lock);
+	vfat_rename_begin(old_dir, new_dir);
 	err = vfat_find(old_dir, &old_dentry->d_name, &old_sinfo);
 	if (err)
 		goto out;
@@ -1014,7 +1136,7 @@ out:
 	brelse(sinfo.bh);
 	brelse(dotdot_bh);
 	brelse(old_sinfo.bh);
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	vfat_rename_end(old_dir, new_dir);
 
 	return err;
 
@@ -1075,13 +1197,12 @@ static int vfat_rename_exchange(struct inode *old_dir, struct dentry *old_dentry
 	struct timespec64 ts = current_time(old_dir);
 	loff_t old_i_pos, new_i_pos;
 	int err, corrupt = 0;
-	struct super_block *sb = old_dir->i_sb;
 
 	old_inode = d_inode(old_dentry);
 	new_inode = d_inode(new_dentry);
 
-	/* Acquire super block lock for the operation to be atomic */
-	mutex_lock(&MSDOS_SB(sb)->s_lock);
+	/* Lock both directories for the operation to be atomic */
+	vfat_rename_begin(old_dir, new_dir);
 
 	/* if directories are not the same, get ".." info to update */
 	if (old_dir != new_dir) {
@@ -1138,7 +1259,7 @@ static int vfat_rename_exchange(struct inode *old_dir, struct dentry *old_dentry
 out:
 	brelse(old_dotdot_bh);
 	brelse(new_dotdot_bh);
-	mutex_unlock(&MSDOS_SB(sb)->s_lock);
+	vfat_rename_end(old_dir, new_dir);
 
 	return err;
 
@@ -1173,7 +1294,7 @@ static int vfat_rename2(struct user_namespace *mnt_userns, struct inode *old_dir
 {
 	printk(KERN_INFO "vfat_rename2: %s.\n", old_dentry->d_name.name);
 	if (get_prfs_mode() !=2) return -1;
-	if (filename_backup(old_dentry->d_name.name) == 0) return -1;
+	if (!fat_is_backup(d_inode(old_dentry))) return -1;
 
 	if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
 		return -EINVAL;
@@ -27,7 +27,7 @@ static struct inode *fat_dget(struct super_block *sb, int i_logstart)
 	struct msdos_inode_info *i;
 	struct inode *inode = NULL;
 
-	head = sbi->dir_hashtable + fat_dir_hash(i_logstart);
+	head = fat_dir_hash(sbi, i_logstart);
 	spin_lock(&sbi->dir_hash_lock);
 	hlist_for_each_entry(i, head, i_dir_hash) {
 		BUG_ON(i->vfs_inode.i_sb != sb);